@@ -18,7 +18,8 @@
 /* A few quick notes about reading this source code:
  * - The code is divided into four sections, which are easily findable with
  *   any string searching tool (grep, ctrl+f):
- *   "decls:", "main:", "responses:", "privfuncs:", "pubfuncs:".
+ *   "decls:", "main:", "responses:", "privfuncs:", "pubfuncs:", "benches:",
+ *   "fuzz:".
  *   Search the text inbetween the quotes to find the section.
  * - The code should compile on any system which supports the POSIX socket API
  *   and has a C89 compiler.
@@ -26,13 +27,42 @@
  *   Especially the HTTP parsing and writing parts!!
  */
 
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L /* For pread. */
+#ifdef RISKYCHAT_LIBFUZZER
+/* libFuzzer brings its own main, which calls LLVMFuzzerTestOneInput. */
+#define RISKYCHAT_FUZZ
+#define main riskychat_main
+#endif
+/* The default settings, which can be changed at runtime, see options. */
 #define RISKYCHAT_HOST "127.0.0.1"
 #define RISKYCHAT_PORT "8000"
 #define RISKYCHAT_VERBOSE 0
 #define RISKYCHAT_MAX_CONNECTIONS 1000
 #define RISKYCHAT_MAX_USERS 1000
+#define RISKYCHAT_MAX_ROOMS 100
 #define RISKYCHAT_TIMEOUT 300
+#define RISKYCHAT_MAX_LOGIN_BODY 256
+#define RISKYCHAT_MAX_POST_BODY 4096
+#define RISKYCHAT_BODY_POOL 64
+#define RISKYCHAT_MAX_CONNECTIONS_PER_IP 32
+#define RISKYCHAT_ACCEPT_BATCH 64
+#define RISKYCHAT_POST_BURST 10
+#define RISKYCHAT_POST_REFILL 3
+#define RISKYCHAT_MAX_LINE 8192
+#define RISKYCHAT_HEADER_TIMEOUT 10
+#define RISKYCHAT_BODY_TIMEOUT 30
+#define RISKYCHAT_WRITE_TIMEOUT 30
+#define RISKYCHAT_BACKLOG SOMAXCONN
+#define RISKYCHAT_HISTORY_LIMIT 0 /* Bytes of posts to keep, 0 for all. */
+#define RISKYCHAT_ROOM_TIMEOUT 86400
+#define RISKYCHAT_HTTP2 1 /* Accept h2c, HTTP/2 without TLS, see handle_h2. */
+#define RISKYCHAT_CONTROL_SOCKET "" /* For restarts, see take_over. */
+#define RISKYCHAT_REPLICATE_LISTEN "" /* For other instances, see peer. */
+#define RISKYCHAT_PEERS ""
+
+#ifdef _WIN32
+#define _CRT_RAND_S /* For rand_s, used for the session tokens. */
+#endif
 
 #include <errno.h>
 #include <stdio.h>
@@ -46,22 +76,48 @@
 typedef SSIZE_T ssize_t;
 /* Sockets: */
 #include <winsock2.h>
+typedef int socklen_t;
 #define SHUT_RDWR SD_BOTH
 #define close closesocket
+/* For connection_sendv, which sends the first buffer with send(). */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
 #pragma comment(lib, "Ws2_32.lib")
 #else
+#ifdef __linux__
+/* Zero-copy chat history: */
+#include <sys/sendfile.h>
+#endif
 /* Sockets: */
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+/* Non-blocking connects to the peers, and socketpairs for the fuzzer: */
+#include <fcntl.h>
 /* Signals: */
 #include <signal.h>
 #define SOCKET_ERROR (-1)
 #define INVALID_SOCKET (-1)
 #endif
 
+#ifdef RISKYCHAT_TLS
+/* TLS, link with -lssl -lcrypto: */
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+/* Vectorized scanning for decode_percent: */
+#include <emmintrin.h>
+#define RISKYCHAT_SSE2
+#endif
+
 /* decls: Declarations used by the rest of the program. */
 
 enum http_method {
@@ -74,28 +130,532 @@ enum resource {
   UNKNOWN_RESOURCE,
   RESOURCE_INDEX,
   RESOURCE_LOGIN,
-  RESOURCE_NEW_POST
+  RESOURCE_NEW_POST,
+  RESOURCE_SEARCH,
+  RESOURCE_METRICS
+};
+
+enum response {
+  RESPONSE_LOGIN,
+  RESPONSE_REDIRECT_TO_CHAT,
+  RESPONSE_REDIRECT_TO_ROOM,
+  RESPONSE_ADD_USER,
+  RESPONSE_CHAT,
+  RESPONSE_SEARCH,
+  RESPONSE_METRICS,
+  RESPONSE_400,
+  RESPONSE_404,
+  RESPONSE_413,
+  RESPONSE_429,
+  RESPONSE_503,
+  RESPONSE_COUNT
+};
+
+#define SESSION_TOKEN_LEN 16
+#define ROOM_NAME_MAX 32
+#define OUTPUT_SEGMENTS_MAX 8 /* Enough for any response. */
+#define H2_UPGRADE_SETTINGS_MAX 48 /* Each of the 8 settings once. */
+
+/* Where an output segment's bytes are, and who frees them. */
+enum output_owner {
+  OUTPUT_BORROWED, /* Memory which outlives the response, like a static. */
+  OUTPUT_OWNED,    /* Memory from malloc, freed when sent or dropped. */
+  OUTPUT_FILE      /* A range of a file, like a room's history. */
+};
+
+/* A piece of a response, queued with queue_output and sent by flush_output.
+ * start moves towards end as the bytes are sent. They are offsets into data,
+ * or into file for OUTPUT_FILE. */
+struct output_segment {
+  char *data;
+  FILE *file;
+  size_t start;
+  size_t end;
+  enum output_owner owner;
 };
 
 struct connection_ctx {
   int connect_fd;
+#ifdef RISKYCHAT_TLS
+  SSL *ssl; /* NULL when serving plain HTTP. */
+  int handshake_done;
+#endif
+  unsigned long ip;
+  time_t deadline;
   char *buffer;
   size_t buffer_len;
   size_t read_len;
-  size_t written_len;
   int user_id;
   int stage;
   enum http_method method;
-  enum resource requested_resource;
+  struct route *route;
+  char *query; /* After the '?' in the request target, NULL if none. */
+  char room_name[ROOM_NAME_MAX + 1]; /* Empty for the main room. */
+  int room; /* Index into ROOMS, -1 if the room doesn't exist yet. */
+  enum response response;
   size_t expected_content_length;
+  /* The riskyid cookie, looked up when processing the request. */
+  unsigned char session_token[SESSION_TOKEN_LEN];
+  int has_session_token;
+  /* The request body, from the body pool, and the form parsing state. */
+  char *body;
+  size_t body_len;
+  size_t form_field_start;
+  size_t form_value_start;
+  char *form_value;
+  size_t form_value_len;
+  /* The response, output[output_first] onwards is yet to be sent. */
+  struct output_segment output[OUTPUT_SEGMENTS_MAX];
+  int output_first;
+  int output_len;
+  struct h2_connection *h2; /* Set when switching to HTTP/2, see handle_h2. */
+  unsigned long stream_id;  /* The request's HTTP/2 stream, 0 for HTTP/1.1. */
+  /* The H2_UPGRADE_* headers seen, and the decoded HTTP2-Settings. */
+  int h2_upgrade;
+  unsigned char h2_settings[H2_UPGRADE_SETTINGS_MAX];
+  size_t h2_settings_len;
+};
+
+/* Picks the response to a request, see routes. */
+typedef void (*route_handler)(struct connection_ctx *ctx);
+
+/* A path, with the resource it serves and a handler for each method it
+ * takes, indexed by enum http_method. The other methods get a 400. */
+struct route {
+  char *path;
+  enum resource resource;
+  route_handler handlers[3];
+};
+
+/* HTTP/2 (RFC 9113) over plain TCP, h2c, see handle_h2. */
+#define H2_FRAME_HEADER_LEN 9
+#define H2_FRAME_MAX 16384 /* SETTINGS_MAX_FRAME_SIZE, left at the minimum. */
+#define H2_STREAMS_MAX 8   /* SETTINGS_MAX_CONCURRENT_STREAMS. */
+#define H2_HEADER_BLOCK_MAX 16384
+#define H2_WINDOW_MAX 0x7FFFFFFFL
+#define H2_CONTROL_MAX 32 /* The most bytes sent in reply to one frame. */
+#define H2_OUT_LEN (2 * (H2_FRAME_HEADER_LEN + H2_FRAME_MAX))
+/* The most an HPACK header block of a response takes, see encode_h2_head. Each
+ * header is at most twice its length, with a lot of room for the status and
+ * the length. */
+#define H2_HEAD_LEN(headers) (64 + 2 * strlen(headers))
+
+enum h2_frame_type {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+};
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+enum h2_error {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xB
+};
+
+/* The headers of an HTTP/1.1 request asking to upgrade to h2c. */
+#define H2_UPGRADE_TOKEN 0x1    /* Upgrade: h2c */
+#define H2_UPGRADE_SETTINGS 0x2 /* HTTP2-Settings, with whole settings. */
+
+#define HPACK_TABLE_SIZE 4096 /* SETTINGS_HEADER_TABLE_SIZE, the default. */
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_ENTRIES_MAX (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+/* The HPACK (RFC 7541) dynamic table of the headers the client has sent, a
+ * ring of entries, newest first. The sizes count the overhead of each. */
+struct hpack_table {
+  char *names[HPACK_ENTRIES_MAX];
+  char *values[HPACK_ENTRIES_MAX];
+  int first;
+  int len;
+  size_t size;
+  size_t max_size;
 };
 
+/* A request and its response on an HTTP/2 connection. The request has a
+ * connection_ctx of its own, so that it goes through the same handlers and
+ * queue_response as the HTTP/1.1 ones. */
+struct h2_stream {
+  unsigned long id; /* 0 for an unused slot. */
+  struct connection_ctx ctx;
+  long window;       /* The bytes of DATA the client can take. */
+  int remote_closed; /* The client has sent END_STREAM. */
+  int has_method;
+  int malformed;
+};
+
+/* An HTTP/2 connection's state, besides the connection_ctx of its socket. */
+struct h2_connection {
+  unsigned char in[H2_FRAME_HEADER_LEN + H2_FRAME_MAX]; /* The frame read. */
+  size_t in_len;
+  size_t preface_left; /* The bytes of the client's preface yet to come. */
+  int settings_received;
+  /* A header block, which can be split into HEADERS and CONTINUATIONs. */
+  unsigned char *header_block;
+  size_t header_block_len;
+  size_t header_block_cap;
+  unsigned long header_stream; /* 0 when not in a header block. */
+  int header_end_stream;
+  time_t header_deadline; /* For the block, which becomes the stream's. */
+  time_t idle_deadline;   /* For when there are no streams. */
+  struct hpack_table decoder;
+  unsigned char out[H2_OUT_LEN]; /* The frames being sent. */
+  size_t out_start;
+  size_t out_len;
+  long window;         /* The bytes of DATA the client can take in total. */
+  long initial_window; /* For new streams, from the client's SETTINGS. */
+  unsigned long last_stream_id;
+  int goaway;      /* No new streams, close when the last one is done. */
+  int closing;     /* Close once the output has been sent. */
+  int eof;         /* The client has stopped sending. */
+  int next_stream; /* Where the streams take turns sending from. */
+  int streams_len;
+  struct h2_stream streams[H2_STREAMS_MAX];
+};
+
+/* A logged in user. The slots of expired users are linked into a free list
+ * through next_free, and their names are NULL. The users expire when their
+ * timer in USER_TIMERS does. */
 struct user {
   char *name;
-  time_t refresh_time;
+  int next_free;
+  unsigned char token[SESSION_TOKEN_LEN]; /* The riskyid cookie, in hex. */
+};
+
+#define SEARCH_WORD_MAX 32 /* Longer words are indexed by their start. */
+#define SEARCH_WORDS_MAX 8 /* The most words in a query. */
+#define SEARCH_RESULTS_MAX 50
+
+/* The posts a word is in, as ascending indices into a room's post_offsets.
+ * Each is stored as the difference from the previous one (the first as is),
+ * in a varint: 7 bits per byte, low bits first, with the high bit set on all
+ * but the last byte. */
+struct posting_list {
+  char *word; /* NULL for an unused slot. */
+  unsigned char *deltas;
+  size_t deltas_len, deltas_cap;
+  size_t last_post;
+  size_t posts_len;
+};
+
+/* The words of a room's posts, in an open addressing hash table of posting
+ * lists, see index_post. */
+struct search_index {
+  struct posting_list *lists;
+  size_t lists_cap; /* A power of two, or 0 before the first word. */
+  size_t lists_len;
+  size_t bytes; /* Allocated for the table and the lists, for /metrics. */
+};
+
+/* Splits text into words, a piece at a time, see next_word. The words are
+ * runs of ASCII letters (lowercased) and digits, and any non-ASCII bytes, so
+ * UTF-8 text stays in one piece. Tags are skipped. */
+struct word_splitter {
+  char word[SEARCH_WORD_MAX + 1];
+  size_t word_len;
+  int in_tag;
+};
+
+/* A position in a posting list, at the post in post, see search_posts. */
+struct posting_cursor {
+  struct posting_list *list;
+  size_t pos;
+  size_t post;
+};
+
+/* A chat room, with the rendered posts appended to its history file as they
+ * come in. The main room, at /, is ROOMS[0]. The others are at /r/<name>/,
+ * and are only created when the first post is made, so looking around the
+ * rooms doesn't take up anything. They are removed when their timer in
+ * ROOM_TIMERS expires, after CONFIG.room_timeout without posts, and their
+ * slots are linked into a free list through next_free. A free slot has no
+ * history file. */
+struct room {
+  char name[ROOM_NAME_MAX + 1];
+  int next_free;
+  FILE *history;
+  size_t history_len;
+  /* The posts before history_start are past CONFIG.history_limit, and are
+   * cut out of the file once no responses are reading it. */
+  size_t history_start;
+  size_t *post_offsets; /* Where each post starts in history. */
+  size_t posts_first, posts_len, posts_cap;
+  int readers;
+  struct search_index index; /* Of the posts from posts_first on. */
+};
+
+/* A hierarchical timer wheel, with one second ticks. The timers are
+ * identified by indices into the timers array, and are linked together by
+ * index, so the timers of array elements can be moved along with them. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+struct timer {
+  int next;
+  int prev;
+  int level; /* -1 when the timer is not scheduled. */
+  int slot;
+  time_t deadline;
+};
+
+struct timer_wheel {
+  struct timer *timers;
+  int slots[2][TIMER_WHEEL_SLOTS];
+  time_t now;
+};
+
+/* A token bucket for rate limiting posts, refilled lazily when used. */
+enum rate_key_kind { RATE_KEY_UNUSED, RATE_KEY_USER, RATE_KEY_IP };
+
+struct rate_bucket {
+  enum rate_key_kind kind;
+  unsigned long key;
+  int tokens;
+  time_t refill_time;
+};
+
+/* A response which is the same every time, see static_responses. */
+struct static_response {
+  enum response response; /* The slot it's in, checked at startup. */
+  char *status;
+  char *headers;
+  char *body;
+  size_t body_len;
+  char *raw;
+  size_t raw_len;
+  size_t head_len; /* The length of the status line and headers in raw. */
+};
+
+/* The settings, see options. */
+struct config {
+  char *address;
+  char *port;
+  long verbose;
+  long max_connections;
+  long max_connections_per_ip;
+  long max_users;
+  long max_rooms;
+  long timeout;
+  long header_timeout;
+  long body_timeout;
+  long write_timeout;
+  long max_line;
+  long max_login_body;
+  long max_post_body;
+  long body_pool;
+  long accept_batch;
+  long backlog;
+  long post_burst;
+  long post_refill;
+  long history_limit;
+  long room_timeout;
+  long http2;
+  char *control_socket;
+  char *replicate_listen;
+  char *peers;
+};
+
+/* A setting, settable with --name on the command line, name = value in the
+ * config file, and the env variable. Either string or number is set. */
+struct option {
+  char *name;
+  char *env;
+  char **string;
+  long *number;
+  long min;
+  char *help;
+  char *allocated; /* The string set_option last set, to free. */
+};
+
+/* The start of a snapshot of the server's state, passed on to a restarted
+ * server. Followed by a snapshot_room and the post offsets for each room, a
+ * snapshot_user and the name for each user, and the rate buckets. Only read
+ * by the same build on the same machine, so the structs are written as they
+ * are. */
+#define SNAPSHOT_MAGIC "RISKY05"
+
+struct snapshot_header {
+  char magic[sizeof SNAPSHOT_MAGIC];
+  int rooms_len;
+  int users_len;
+  int free_users;
+  int free_rooms;
+};
+
+/* The rooms' history files are sent after the snapshot, in the same order,
+ * except for the free slots, which have an empty name. */
+struct snapshot_room {
+  char name[ROOM_NAME_MAX + 1];
+  int next_free;
+  time_t deadline;
+  size_t history_len;
+  size_t history_start;
+  size_t posts_len;
+};
+
+/* The most descriptors sent in one message during a hand off, well under the
+ * kernel's limit. The rooms' history files are sent in batches of these. */
+#define HANDOFF_FDS_MAX 64
+
+struct snapshot_user {
+  size_t name_len; /* Including the NUL, 0 for free slots. */
+  int next_free;
+  time_t deadline;
+  unsigned char token[SESSION_TOKEN_LEN];
+};
+
+/* After the rate buckets: the event offsets and the replication log, and a
+ * snapshot_peer and the address for each peer. The listening replication
+ * socket is sent after the history files, if there is one. */
+struct snapshot_replication {
+  unsigned char epoch[SESSION_TOKEN_LEN];
+  unsigned long events_first, events_len;
+  size_t log_len;
+  int peers_len;
+  int has_listener;
+};
+
+struct snapshot_peer {
+  size_t address_len;
+  unsigned char epoch[SESSION_TOKEN_LEN];
+  unsigned long next_seq;
+};
+
+/* Replication: every instance appends its own logins and posts to a log of
+ * events, numbered from 0, which the other instances follow over a stream
+ * socket. A follower starts with a request of the epoch and sequence number
+ * it has seen up to, and its own epoch to tell it apart, and gets the same
+ * epoch and the number it's sent from in return, followed by the events. The
+ * follower then acknowledges the events it has applied, with the number of
+ * the next one as 4 bytes. The start of the log is dropped once every
+ * follower has acknowledged it, or when it goes over CONFIG.history_limit.
+ * The epoch changes when an instance starts from scratch. A follower which
+ * has seen another epoch, or asks for events which were dropped, is resynced:
+ * it's sent all the users logged in first, and then the log from its start.
+ * The events are a type byte, the length of the rest as 4 big-endian bytes,
+ * and:
+ * - 'L' (login): the session token, and the name with a length byte.
+ * - 'P' (post): the session token, the name and the room's name with length
+ *   bytes, and the post's contents.
+ * - 'R' (resync): like 'L', but only sent in a resync, and not numbered. */
+#define REPLICATION_HELLO_LEN (SESSION_TOKEN_LEN + 4)
+#define REPLICATION_REQUEST_LEN (REPLICATION_HELLO_LEN + SESSION_TOKEN_LEN)
+#define REPLICATION_EVENT_MAX 0x1000000UL
+/* The most a post can have in its event, besides the token and the names. */
+#define REPLICATION_POST_MAX                                                   \
+  (REPLICATION_EVENT_MAX - SESSION_TOKEN_LEN - (1 + 30) - (1 + ROOM_NAME_MAX))
+#define FOLLOWERS_MAX 64
+
+/* Another instance, following this one's log. */
+struct follower {
+  int fd;
+  /* For the request, like the header timeout, and then for the resync, like
+   * the write timeout. */
+  time_t deadline;
+  unsigned char request[REPLICATION_REQUEST_LEN];
+  size_t request_len;
+  int streaming;
+  int known; /* Its index in KNOWN_FOLLOWERS, -1 if there was no room. */
+  unsigned char *resync; /* The 'R' events, sent before the log. */
+  size_t resync_len, resync_sent;
+  size_t sent; /* The offset in the log sent up to, when streaming. */
+  unsigned char ack[4];
+  size_t ack_len;
+};
+
+/* How far a follower has acknowledged the log, kept while it reconnects, so
+ * the events it hasn't seen yet aren't dropped. Forgotten once it has been
+ * away for CONFIG.timeout, as it's then likely gone for good. */
+struct known_follower {
+  unsigned char epoch[SESSION_TOKEN_LEN];
+  unsigned long acked;
+  time_t seen;
 };
 
+/* Another instance, whose log this one follows, see CONFIG.peers. */
+struct peer {
+  char *address;
+  int fd;              /* -1 when disconnected. */
+  int connecting;      /* Set until the non-blocking connect finishes. */
+  time_t retry_at;     /* When to reconnect, or to give up connecting. */
+  time_t retry_delay;  /* Doubled after each failure, up to 16 seconds. */
+  int streaming;       /* Set once the reply to the request is read. */
+  unsigned char epoch[SESSION_TOKEN_LEN];
+  unsigned long next_seq;
+  unsigned char *buffer; /* Received, but not yet applied. */
+  size_t buffer_len, buffer_cap;
+};
+
+/* The count of open connections from an IP, used for the per-IP limit. */
+struct ip_count {
+  unsigned long ip;
+  int count; /* 0 when the entry is not in use. */
+};
+
+static int configure(int argc, char **argv, char **positional,
+                     int *positional_len);
+static int allocate_tables(void);
+static void free_tables(void);
+#ifndef _WIN32
+static int take_over(void);
+static int finish_take_over(void);
+static int listen_after_start(void);
+static int offer_listener(int listen_fd);
+static int handoff_abandoned(void);
+static int needs_state(struct connection_ctx *ctx);
+static int hand_off(void);
+static void detach_connection(struct connection_ctx *ctx);
+static int init_replication(void);
+static int listen_replication(void);
+static void poll_replication(void);
+static void free_replication(int handed_off);
+static void publish_login(int user_id);
+static void publish_post(char *room_name, int user_id, char *content,
+                         size_t content_len);
+#endif
 static int connect_socket(char *addr, char *port);
+static int init_timer_wheel(struct timer_wheel *wheel, int timers_len,
+                            time_t now);
+static void schedule_timer(struct timer_wheel *wheel, int id, time_t deadline);
+static void cancel_timer(struct timer_wheel *wheel, int id);
+static void move_timer(struct timer_wheel *wheel, int from, int to);
+static int expire_timer(struct timer_wheel *wheel, time_t now);
+static void remove_user(int user_id);
+static void remove_room(int room);
+static int add_ip_connection(unsigned long ip);
+static void remove_ip_connection(unsigned long ip);
+static void reject_connection(int fd);
+static int build_static_responses(void);
+static void build_routes(void);
+static void build_huffman(void);
+static void free_static_responses(void);
+static time_t monotonic_time(void);
+#ifdef RISKYCHAT_TLS
+static SSL_CTX *create_tls_context(char *certificate_path, char *key_path);
+#endif
 static int handle_connection(struct connection_ctx *ctx);
 static void cleanup_connection(struct connection_ctx *ctx);
 static void remove_connection(struct connection_ctx **contexts,
@@ -104,22 +664,173 @@ static void remove_connection(struct connection_ctx **contexts,
 static void handle_terminate(int sig);
 #endif
 static void printf_clear_line(void);
-static void print_usage(char *program_name);
+static void print_usage(FILE *out, char *program_name);
+#ifdef RISKYCHAT_DECODE_BENCH
+static int decode_bench(void);
+#endif
+#ifdef RISKYCHAT_SEARCH_BENCH
+static int search_bench(void);
+#endif
+#ifdef RISKYCHAT_FUZZ
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+static int fuzz_io_fault(size_t *len);
+static int fuzz_main(int argc, char **argv);
+#endif
 
 /* main: The main function */
 
 static int SERVER_TERMINATED = 0;
-static struct user *USERS;
+static struct config CONFIG = {
+    RISKYCHAT_HOST,
+    RISKYCHAT_PORT,
+    RISKYCHAT_VERBOSE,
+    RISKYCHAT_MAX_CONNECTIONS,
+    RISKYCHAT_MAX_CONNECTIONS_PER_IP,
+    RISKYCHAT_MAX_USERS,
+    RISKYCHAT_MAX_ROOMS,
+    RISKYCHAT_TIMEOUT,
+    RISKYCHAT_HEADER_TIMEOUT,
+    RISKYCHAT_BODY_TIMEOUT,
+    RISKYCHAT_WRITE_TIMEOUT,
+    RISKYCHAT_MAX_LINE,
+    RISKYCHAT_MAX_LOGIN_BODY,
+    RISKYCHAT_MAX_POST_BODY,
+    RISKYCHAT_BODY_POOL,
+    RISKYCHAT_ACCEPT_BATCH,
+    RISKYCHAT_BACKLOG,
+    RISKYCHAT_POST_BURST,
+    RISKYCHAT_POST_REFILL,
+    RISKYCHAT_HISTORY_LIMIT,
+    RISKYCHAT_ROOM_TIMEOUT,
+    RISKYCHAT_HTTP2,
+    RISKYCHAT_CONTROL_SOCKET,
+    RISKYCHAT_REPLICATE_LISTEN,
+    RISKYCHAT_PEERS,
+};
+static struct user *USERS; /* Allocated for CONFIG.max_users + 1 users. */
 static int USERS_LEN;
-static char *POSTS;
-static int POSTS_LEN;
+static int FREE_USERS; /* The first free slot in USERS, 0 if none. */
+static struct timer_wheel USER_TIMERS;
+static struct room *ROOMS; /* Allocated for CONFIG.max_rooms + 1 rooms. */
+static int ROOMS_LEN;
+static int FREE_ROOMS; /* The first free slot in ROOMS, 0 if none. */
+static struct timer_wheel ROOM_TIMERS;
+static char **BODY_POOL;
+static int BODY_POOL_LEN;
+static time_t NOW; /* Monotonic seconds, updated once per loop. */
+static struct timer_wheel CONNECTION_TIMERS;
+/* The hash tables below are sized by allocate_tables to powers of two, with
+ * room to spare to keep the linear probing short. */
+static struct ip_count *IP_COUNTS;
+static unsigned long IP_COUNTS_LEN;
+#define RATE_BUCKETS_LEN 4096
+static struct rate_bucket RATE_BUCKETS[RATE_BUCKETS_LEN];
+/* Session tokens to user ids, 0 marks an unused entry. */
+static int *SESSIONS;
+static unsigned long SESSIONS_LEN;
+/* The names of the users to user ids, like SESSIONS. */
+static int *NAMES;
+static unsigned long NAMES_LEN;
+/* The names of the rooms to their indices in ROOMS, like SESSIONS. */
+static int *ROOM_NAMES;
+static unsigned long ROOM_NAMES_LEN;
+#ifndef _WIN32
+static FILE *RANDOM_SOURCE; /* /dev/urandom, for the session tokens. */
+#endif
+#ifdef RISKYCHAT_TLS
+static SSL_CTX *TLS_CONTEXT; /* NULL when serving plain HTTP. */
+#endif
+/* The listening control socket, and a restarted server connected to it,
+ * waiting for a hand off. -1 when not in use. */
+static int CONTROL_FD = -1;
+static int HANDOFF_FD = -1;
+/* The connection to the running server, while waiting for its state after
+ * taking over its listening socket, and when to give up. See take_over. */
+static int TAKEOVER_FD = -1;
+static time_t TAKEOVER_DEADLINE;
+#ifndef _WIN32
+/* The replication log of this instance's logins and posts, from event
+ * EVENTS_FIRST on, and where each of those starts in it, see struct peer.
+ * EVENTS_LEN is the number of the next event. Only kept with
+ * replicate-listen. */
+static unsigned char REPLICATION_EPOCH[SESSION_TOKEN_LEN];
+static unsigned char *REPLICATION_LOG;
+static size_t REPLICATION_LOG_LEN, REPLICATION_LOG_CAP;
+static size_t *EVENT_OFFSETS;
+static unsigned long EVENTS_FIRST, EVENTS_LEN, EVENTS_CAP;
+static int REPLICATION_FD = -1; /* The listening replication socket. */
+static struct follower FOLLOWERS[FOLLOWERS_MAX];
+static int FOLLOWERS_LEN;
+static struct known_follower KNOWN_FOLLOWERS[FOLLOWERS_MAX];
+static int KNOWN_FOLLOWERS_LEN;
+static struct peer *PEERS;
+static int PEERS_LEN;
+#endif
+
+static struct option options[] = {
+    {"address", "RISKYCHAT_HOST", &CONFIG.address, NULL, 0,
+     "the address to listen on", NULL},
+    {"port", "RISKYCHAT_PORT", &CONFIG.port, NULL, 0, "the port to listen on",
+     NULL},
+    {"verbose", "RISKYCHAT_VERBOSE", NULL, &CONFIG.verbose, 0,
+     "how much to log, 0-3", NULL},
+    {"max-connections", "RISKYCHAT_MAX_CONNECTIONS", NULL,
+     &CONFIG.max_connections, 1, "connections open at once", NULL},
+    {"max-connections-per-ip", "RISKYCHAT_MAX_CONNECTIONS_PER_IP", NULL,
+     &CONFIG.max_connections_per_ip, 1, "connections open at once per IP",
+     NULL},
+    {"max-users", "RISKYCHAT_MAX_USERS", NULL, &CONFIG.max_users, 1,
+     "users logged in at once", NULL},
+    {"max-rooms", "RISKYCHAT_MAX_ROOMS", NULL, &CONFIG.max_rooms, 0,
+     "rooms besides the main one", NULL},
+    {"timeout", "RISKYCHAT_TIMEOUT", NULL, &CONFIG.timeout, 1,
+     "seconds until an inactive user is logged out", NULL},
+    {"header-timeout", "RISKYCHAT_HEADER_TIMEOUT", NULL, &CONFIG.header_timeout,
+     1, "seconds to receive the request line and headers in", NULL},
+    {"body-timeout", "RISKYCHAT_BODY_TIMEOUT", NULL, &CONFIG.body_timeout, 1,
+     "seconds to receive the request body in", NULL},
+    {"write-timeout", "RISKYCHAT_WRITE_TIMEOUT", NULL, &CONFIG.write_timeout, 1,
+     "seconds to send the response in", NULL},
+    {"max-line", "RISKYCHAT_MAX_LINE", NULL, &CONFIG.max_line, 16,
+     "bytes in the request line or a header", NULL},
+    {"max-login-body", "RISKYCHAT_MAX_LOGIN_BODY", NULL, &CONFIG.max_login_body,
+     1, "bytes in a login request's body", NULL},
+    {"max-post-body", "RISKYCHAT_MAX_POST_BODY", NULL, &CONFIG.max_post_body, 1,
+     "bytes in a post request's body", NULL},
+    {"body-pool", "RISKYCHAT_BODY_POOL", NULL, &CONFIG.body_pool, 0,
+     "request body buffers kept for reuse", NULL},
+    {"accept-batch", "RISKYCHAT_ACCEPT_BATCH", NULL, &CONFIG.accept_batch, 1,
+     "connections accepted per loop", NULL},
+    {"backlog", "RISKYCHAT_BACKLOG", NULL, &CONFIG.backlog, 1,
+     "connections waiting to be accepted", NULL},
+    {"post-burst", "RISKYCHAT_POST_BURST", NULL, &CONFIG.post_burst, 1,
+     "posts a user or IP can make in a burst", NULL},
+    {"post-refill", "RISKYCHAT_POST_REFILL", NULL, &CONFIG.post_refill, 1,
+     "seconds until another post is allowed", NULL},
+    {"history-limit", "RISKYCHAT_HISTORY_LIMIT", NULL, &CONFIG.history_limit, 0,
+     "bytes of posts kept, 0 for all", NULL},
+    {"room-timeout", "RISKYCHAT_ROOM_TIMEOUT", NULL, &CONFIG.room_timeout, 1,
+     "seconds until a room without posts is removed", NULL},
+    {"http2", "RISKYCHAT_HTTP2", NULL, &CONFIG.http2, 0,
+     "1 to take HTTP/2 without TLS (h2c), 0 not to", NULL},
+#ifndef _WIN32
+    {"control-socket", "RISKYCHAT_CONTROL_SOCKET", &CONFIG.control_socket, NULL,
+     0, "a unix socket path, for restarting without downtime", NULL},
+    {"replicate-listen", "RISKYCHAT_REPLICATE_LISTEN", &CONFIG.replicate_listen,
+     NULL, 0, "host:port or unix socket path to stream logins and posts on",
+     NULL},
+    {"peers", "RISKYCHAT_PEERS", &CONFIG.peers, NULL, 0,
+     "comma-separated replicate-listen addresses of the other instances", NULL},
+#endif
+};
 
 int main(int argc, char **argv) {
-  int result, socket_fd, connect_fd, i;
-  int connections_len, allocated_conns_len;
-  size_t new_size;
-  char *addr, *port;
-  struct connection_ctx *connections, *new_connections;
+  int result, socket_fd, connect_fd, i, accepted, handed_off;
+  int connections_len, positional_len;
+  char *positional[4];
+  struct connection_ctx *connections;
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
 
 #ifndef _WIN32
   struct sigaction sa;
@@ -136,24 +847,124 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  if (argc == 1) {
-    addr = RISKYCHAT_HOST;
-    port = RISKYCHAT_PORT;
-  } else if (argc == 3) {
-    addr = argv[1];
-    port = argv[2];
-  } else {
-    print_usage(argv[0]);
+#ifdef RISKYCHAT_DECODE_BENCH
+  return decode_bench();
+#endif
+#ifdef RISKYCHAT_SEARCH_BENCH
+  return search_bench();
+#endif
+#ifdef RISKYCHAT_FUZZ
+  return fuzz_main(argc, argv);
+#endif
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+      print_usage(stdout, argv[0]);
+      return 0;
+    }
+  }
+  if (configure(argc, argv, positional, &positional_len) == -1) {
+    print_usage(stderr, argv[0]);
+    return 1;
+  }
+  if (positional_len == 2) {
+    CONFIG.address = positional[0];
+    CONFIG.port = positional[1];
+#ifdef RISKYCHAT_TLS
+  } else if (positional_len == 4) {
+    CONFIG.address = positional[0];
+    CONFIG.port = positional[1];
+    TLS_CONTEXT = create_tls_context(positional[2], positional[3]);
+    if (TLS_CONTEXT == NULL) {
+      print_usage(stderr, argv[0]);
+      return 1;
+    }
+#endif
+  } else if (positional_len != 0) {
+    print_usage(stderr, argv[0]);
     return 1;
   }
 
-  /* Creation of the TCP socket we will listen to HTTP connections on. */
-  socket_fd = connect_socket(addr, port);
-  if (socket_fd == -1) {
-    print_usage(argv[0]);
+  if (build_static_responses() == -1)
+    return 1;
+  build_routes();
+  build_huffman();
+
+  /* Allocate everything sized by the settings up front. */
+  connections_len = 0;
+  connections = malloc(CONFIG.max_connections * sizeof connections[0]);
+  if (connections == NULL || allocate_tables() == -1) {
+    perror("error allocating connections and users");
+    return 1;
+  }
+  if (CONFIG.verbose >= 1) {
+    printf("connection buffer: %ld bytes\n",
+           (long)(CONFIG.max_connections * sizeof connections[0]));
+  }
+  USERS_LEN = 1;
+  FREE_USERS = 0;
+#ifndef _WIN32
+  RANDOM_SOURCE = fopen("/dev/urandom", "rb");
+  if (RANDOM_SOURCE == NULL) {
+    perror("error opening /dev/urandom");
+    return 1;
+  }
+#endif
+  NOW = monotonic_time();
+  if (init_timer_wheel(&CONNECTION_TIMERS, CONFIG.max_connections, NOW) ==
+      -1) {
+    perror("error allocating connection timers");
+    return 1;
+  }
+  if (init_timer_wheel(&USER_TIMERS, CONFIG.max_users + 1, NOW) == -1) {
+    perror("error allocating user timers");
+    return 1;
+  }
+  if (init_timer_wheel(&ROOM_TIMERS, CONFIG.max_rooms + 1, NOW) == -1) {
+    perror("error allocating room timers");
+    return 1;
+  }
+
+  /* Take over the listening socket and the state of a running server, when
+   * restarting, or start from scratch. */
+  socket_fd = -1;
+  handed_off = 0;
+#ifndef _WIN32
+  if (init_replication() == -1)
     return 1;
+  if (CONFIG.control_socket[0] != '\0') {
+    socket_fd = take_over();
+    if (socket_fd == -2)
+      return 1;
+  }
+#endif
+  if (socket_fd == -1) {
+    /* Creation of the TCP socket we will listen to HTTP connections on. */
+    socket_fd = connect_socket(CONFIG.address, CONFIG.port);
+    if (socket_fd == -1) {
+      print_usage(stderr, argv[0]);
+      return 1;
+    }
+    ROOMS_LEN = 1;
+    ROOMS[0].history = tmpfile();
+    if (ROOMS[0].history == NULL) {
+      perror("error creating the chat history file");
+      return 1;
+    }
   }
-  printf("Started the Risky Chat server on http://%s:%s.\n", addr, port);
+#ifndef _WIN32
+  /* When taking over, these wait for the running server's state. */
+  if (TAKEOVER_FD == -1 && listen_after_start() == -1)
+    return 1;
+#endif
+#ifdef RISKYCHAT_TLS
+  if (TLS_CONTEXT != NULL) {
+    printf("Started the Risky Chat server on https://%s:%s.\n", CONFIG.address,
+           CONFIG.port);
+  } else
+#endif
+    printf("Started the Risky Chat server on http://%s:%s.\n", CONFIG.address,
+           CONFIG.port);
 
 #ifndef _WIN32
   /* Setup interrupt handler. */
@@ -171,23 +982,34 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  /* Let's not allocate anything before it's needed. */
-  allocated_conns_len = 0;
-  connections_len = 0;
-  connections = NULL;
-  USERS = NULL;
-  USERS_LEN = 1;
-  POSTS = malloc(1);
-  if (POSTS == NULL) {
-    perror("error allocating a single byte for posts");
-    return 1;
-  }
-  POSTS[0] = '\0';
-  POSTS_LEN = 0;
-
   /* The main listening loop. */
   while (!SERVER_TERMINATED) {
     fflush(stdout);
+    NOW = monotonic_time();
+
+#ifndef _WIN32
+    if (TAKEOVER_FD != -1) {
+      result = finish_take_over();
+      if (result == -1 || (result == 0 && listen_after_start() == -1))
+        return 1;
+    }
+#endif
+
+    /* Log out the users who haven't been active for CONFIG.timeout. After
+     * a hand off, they're the restarted server's. */
+    while (!handed_off && (i = expire_timer(&USER_TIMERS, NOW)) != -1)
+      remove_user(i);
+    while (!handed_off && (i = expire_timer(&ROOM_TIMERS, NOW)) != -1)
+      remove_room(i);
+
+    /* Drop the connections which have spent too long in their current stage,
+     * e.g. slowly trickling in their headers. */
+    while ((i = expire_timer(&CONNECTION_TIMERS, NOW)) != -1) {
+      if (CONFIG.verbose >= 2)
+        printf("connection timed out at stage %d\n", connections[i].stage);
+      cleanup_connection(&connections[i]);
+      remove_connection(&connections, &connections_len, i);
+    }
 
     for (i = 0; i < connections_len; i++) {
       result = handle_connection(&connections[i]);
@@ -210,35 +1032,88 @@ int main(int argc, char **argv) {
         cleanup_connection(&connections[i]);
         remove_connection(&connections, &connections_len, i);
         i--;
+      } else if (connections[i].deadline !=
+                 CONNECTION_TIMERS.timers[i].deadline) {
+        /* Moved on to the next stage, which has a deadline of its own. */
+        schedule_timer(&CONNECTION_TIMERS, i, connections[i].deadline);
       }
     }
 
-    if (connections_len < RISKYCHAT_MAX_CONNECTIONS) {
-      connect_fd = accept(socket_fd, NULL, NULL);
-      if (connect_fd != INVALID_SOCKET) {
-        if (connections_len == allocated_conns_len) {
-          allocated_conns_len++;
-          new_size = allocated_conns_len * sizeof connections[0];
-          new_connections = realloc(connections, new_size);
-          if (new_connections == NULL) {
-            perror("could not expand connection buffer");
-            if (errno == ENOMEM) {
-              continue;
-            } else {
-              return 1;
-            }
-          }
-          connections = new_connections;
-          if (RISKYCHAT_VERBOSE >= 1) {
-            printf("connection buffer: %ld bytes\n", new_size);
-          }
-        }
+#ifndef _WIN32
+    if (!handed_off && TAKEOVER_FD == -1)
+      poll_replication();
+
+    /* A restarted server asking to take over: it gets the listening socket
+     * right away, and accepts the new connections from then on. The rest
+     * is handed over once no connection is in the middle of a request, and
+     * the connections left only send their responses. */
+    if (CONTROL_FD != -1 && HANDOFF_FD == -1 && TAKEOVER_FD == -1) {
+      HANDOFF_FD = accept(CONTROL_FD, NULL, NULL);
+      if (HANDOFF_FD != -1 && offer_listener(socket_fd) == -1) {
+        perror("error handing the listening socket off");
+        close(HANDOFF_FD);
+        HANDOFF_FD = -1;
+      } else if (HANDOFF_FD != -1) {
+        printf("Handing off to the restarted server, with %d connections.\n",
+               connections_len);
+      }
+    }
+    if (HANDOFF_FD != -1 && !handed_off) {
+      for (i = 0; i < connections_len && !needs_state(&connections[i]); i++)
+        ;
+      result = handoff_abandoned() ? -1 : i < connections_len ? 1 : hand_off();
+      if (result == 0) {
+        handed_off = 1;
+        for (i = 0; i < connections_len; i++)
+          detach_connection(&connections[i]);
+      } else if (result == -1) {
+        fprintf(stderr, "the restarted server did not take over, resuming\n");
+        close(HANDOFF_FD);
+        HANDOFF_FD = -1;
+      }
+    }
+    if (handed_off && connections_len == 0)
+      break;
+#endif
+
+    /* Accept a batch of connections, so that a backlog of them gets through
+     * (or rejected) without waiting on the other connections. */
+    for (accepted = 0; HANDOFF_FD == -1 && accepted < CONFIG.accept_batch;
+         accepted++) {
+      client_addr_len = sizeof client_addr;
+      connect_fd =
+          accept(socket_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+      if (connect_fd == INVALID_SOCKET)
+        break;
+
+      if (connections_len >= CONFIG.max_connections ||
+          !add_ip_connection(client_addr.sin_addr.s_addr)) {
+        /* Saturated, or this IP has enough connections already. */
+        reject_connection(connect_fd);
+        continue;
+      }
 
-        memset(&connections[connections_len], 0,
-               sizeof connections[connections_len]);
-        connections[connections_len].connect_fd = connect_fd;
-        connections_len++;
+      memset(&connections[connections_len], 0,
+             sizeof connections[connections_len]);
+#ifdef RISKYCHAT_TLS
+      if (TLS_CONTEXT != NULL) {
+        connections[connections_len].ssl = SSL_new(TLS_CONTEXT);
+        if (connections[connections_len].ssl == NULL ||
+            SSL_set_fd(connections[connections_len].ssl, connect_fd) != 1) {
+          ERR_print_errors_fp(stderr);
+          SSL_free(connections[connections_len].ssl);
+          remove_ip_connection(client_addr.sin_addr.s_addr);
+          reject_connection(connect_fd);
+          continue;
+        }
       }
+#endif
+      connections[connections_len].connect_fd = connect_fd;
+      connections[connections_len].ip = client_addr.sin_addr.s_addr;
+      connections[connections_len].deadline = NOW + CONFIG.header_timeout;
+      schedule_timer(&CONNECTION_TIMERS, connections_len,
+                     connections[connections_len].deadline);
+      connections_len++;
     }
   }
 
@@ -247,13 +1122,33 @@ int main(int argc, char **argv) {
     cleanup_connection(&connections[i]);
   }
   close(socket_fd);
+#ifndef _WIN32
+  if (HANDOFF_FD != -1)
+    close(HANDOFF_FD);
+  if (CONTROL_FD != -1) {
+    close(CONTROL_FD);
+    /* After a hand off, the path belongs to the new server. */
+    if (!handed_off)
+      unlink(CONFIG.control_socket);
+  }
+  free_replication(handed_off);
+#endif
 #ifdef _WIN32
   /* Winsock2 cleanup. */
   WSACleanup();
 #endif
   free(connections);
-  free(POSTS);
-  free(USERS);
+  free(CONNECTION_TIMERS.timers);
+  free(USER_TIMERS.timers);
+  free(ROOM_TIMERS.timers);
+  free_tables();
+  free_static_responses();
+#ifdef RISKYCHAT_TLS
+  SSL_CTX_free(TLS_CONTEXT);
+#endif
+#ifndef _WIN32
+  fclose(RANDOM_SOURCE);
+#endif
   printf_clear_line();
   printf("\rGood night!\n");
 
@@ -273,7 +1168,7 @@ button{margin-top:8px;}\
 </style>\
 </head><body>\
 <h3>Login to Risky Chat</h3>\
-<form method=\"POST\" action=\"/login\">\
+<form method=\"POST\" action=\"login\">\
 <input type=\"text\" placeholder=\"Username\" id=\"name\" name=\"name\" autofocus>\
 <br>\
 <button type=\"submit\">Login</button>\
@@ -295,14 +1190,19 @@ border-top:2px solid #DDD;\
 animation:f 0.2s;\
 }</style>\
 </head><body>\
-<form method=\"POST\" action=\"/post\">\
+<form method=\"POST\" action=\"post\">\
 <input type=\"text\" id=\"content\" name=\"content\" autofocus>\
 <br>\
 <button>Post</button>\
 </form><br>\
 <chatbox>\r\n";
 
-static char static_response_chat_tail[] = "</chatbox></body></html>\r\n";
+static char static_response_chat_tail[] = "\
+</chatbox><br>\
+<form action=\"search\">\
+<input type=\"text\" name=\"q\" placeholder=\"Search\">\
+<button>Search</button>\
+</form></body></html>\r\n";
 
 static char static_response_400[] = "\
 400 Bad Request\r\n";
@@ -316,16 +1216,120 @@ static char static_response_404[] = "\
 <h2>404 Not Found</h2>\r\n\
 </body></html>\r\n";
 
+static char static_response_413[] = "\
+413 Payload Too Large\r\n";
+
+static char static_response_429[] = "\
+429 Too Many Requests\r\n";
+
+static char static_response_503[] = "\
+503 Service Unavailable\r\n";
+
+/* The header of the responses above which aren't HTML. */
+static char text_plain[] = "Content-Type: text/plain\r\n";
+
+/* The responses which never change, indexed by enum response. The complete
+ * responses, headers included, are built by build_static_responses() at
+ * startup, so serving them is just a send. The ones without a body are put
+ * together for each request, see queue_response. */
+static struct static_response static_responses[] = {
+    {RESPONSE_LOGIN, "200 OK", "", static_response_login,
+     sizeof static_response_login - 1},
+    {RESPONSE_REDIRECT_TO_CHAT, "303 See Other", "Location: ./\r\n", "", 0},
+    {RESPONSE_REDIRECT_TO_ROOM, "303 See Other"}, /* To the room. */
+    {RESPONSE_ADD_USER, "303 See Other"},         /* With the new cookie. */
+    {RESPONSE_CHAT, "200 OK"},                    /* Written from the posts. */
+    {RESPONSE_SEARCH, "200 OK"},                  /* By process_search. */
+    {RESPONSE_METRICS, "200 OK"},                 /* By process_metrics. */
+    {RESPONSE_400, "400 Bad Request", text_plain, static_response_400,
+     sizeof static_response_400 - 1},
+    {RESPONSE_404, "404 Not Found", "", static_response_404,
+     sizeof static_response_404 - 1},
+    {RESPONSE_413, "413 Payload Too Large", text_plain, static_response_413,
+     sizeof static_response_413 - 1},
+    {RESPONSE_429, "429 Too Many Requests",
+     NULL, /* Retry-After, from CONFIG.post_refill. */
+     static_response_429, sizeof static_response_429 - 1},
+    {RESPONSE_503, "503 Service Unavailable", text_plain, static_response_503,
+     sizeof static_response_503 - 1},
+};
+
+/* Fails to compile if a response is missing from static_responses. */
+#define STATIC_RESPONSES_LEN                                                   \
+  (sizeof static_responses / sizeof static_responses[0])
+typedef char
+    static_responses_complete[STATIC_RESPONSES_LEN == RESPONSE_COUNT ? 1 : -1];
+
 /* privfuncs: Functions used by the functions used in main(). */
 
-/* Reads from the given file descriptor, until a newline (LF) is encountered.
- * The return value is 0 if a line was read in entirety, -1 if not.
+#ifdef RISKYCHAT_TLS
+/* Turns the return value of an SSL_* I/O function into what the equivalent
+ * socket function would have returned: -1 with errno set to EAGAIN when the
+ * operation should be retried, 0 when the peer has closed the connection. */
+static ssize_t tls_result(struct connection_ctx *ctx, ssize_t result) {
+  if (result > 0)
+    return result;
+  switch (SSL_get_error(ctx->ssl, (int)result)) {
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0)
+      errno = ECONNRESET;
+    return -1;
+  default:
+    if (CONFIG.verbose >= 1)
+      ERR_print_errors_fp(stderr);
+    ERR_clear_error();
+    errno = ECONNRESET;
+    return -1;
+  }
+}
+#endif
+
+/* Like recv() and send() on the connection's socket, but through TLS when
+ * it is enabled. */
+static ssize_t connection_recv(struct connection_ctx *ctx, char *buffer,
+                               size_t len) {
+#ifdef RISKYCHAT_FUZZ
+  if (fuzz_io_fault(&len) == -1)
+    return -1;
+#endif
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL)
+    return tls_result(ctx, SSL_read(ctx->ssl, buffer, (int)len));
+#endif
+  return recv(ctx->connect_fd, buffer, len, 0);
+}
+
+static ssize_t connection_send(struct connection_ctx *ctx, char *buffer,
+                               size_t len) {
+#ifdef RISKYCHAT_FUZZ
+  if (fuzz_io_fault(&len) == -1)
+    return -1;
+#endif
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL)
+    return tls_result(ctx, SSL_write(ctx->ssl, buffer, (int)len));
+#endif
+  return send(ctx->connect_fd, buffer, len, 0);
+}
+
+/* Reads from the connection, until a newline (LF) is encountered.
+ * The return value is 0 if a line was read in entirety, -1 if not, -2 if
+ * the line is longer than CONFIG.max_line, and -3 if the connection was closed
+ * before the line ended.
  * This should keep getting called until it returns 0 to get the entire line. */
-static ssize_t read_line(int fd, char **buffer, size_t *buffer_len,
-                         size_t *string_len) {
+static ssize_t read_line(struct connection_ctx *ctx, char **buffer,
+                         size_t *buffer_len, size_t *string_len) {
   ssize_t read_bytes = 0;
 
   for (;;) {
+    if ((long)*string_len >= CONFIG.max_line)
+      return -2;
     if (*string_len >= *buffer_len) {
       *buffer_len += 1024;
       *buffer = realloc(*buffer, *buffer_len);
@@ -335,9 +1339,9 @@ static ssize_t read_line(int fd, char **buffer, size_t *buffer_len,
       }
     }
 
-    read_bytes = recv(fd, &(*buffer)[*string_len], 1, 0);
+    read_bytes = connection_recv(ctx, &(*buffer)[*string_len], 1);
     if (read_bytes == 0) {
-      break;
+      return -3;
     } else if (read_bytes == -1) {
       return -1;
     } else {
@@ -358,271 +1362,477 @@ static ssize_t read_line(int fd, char **buffer, size_t *buffer_len,
   }
   (*buffer)[*string_len] = '\0';
 
-  if (RISKYCHAT_VERBOSE >= 3)
+  if (CONFIG.verbose >= 3)
     printf("%s", *buffer);
 
   return 0;
 }
 
-static char http_response_head[] = "HTTP/1.1 ";
-/* Returns 0 when the entire response has been sent. */
-static ssize_t write_http_response(int fd, size_t *written_len, char *status,
-                                   size_t status_len, char *response,
-                                   size_t response_len, int is_head,
-                                   char *additional_headers) {
-  ssize_t result, target_len, section_start;
-  char buf[128];
-  int buf_len;
-
-  section_start = 0;
-  target_len = sizeof http_response_head - 1;
-  while (*written_len < target_len) {
-    result = send(fd, &http_response_head[*written_len - section_start],
-                  target_len - *written_len, 0);
-    if (result == -1)
-      return -1;
-    else
-      *written_len += result;
-  }
+/* Like connection_send, but gathers the buffers into one send. Without
+ * writev, only the first buffer is sent, and the caller tries again. */
+static ssize_t connection_sendv(struct connection_ctx *ctx, struct iovec *iov,
+                                int iov_len) {
+#ifdef RISKYCHAT_FUZZ
+  size_t len = iov[0].iov_len;
+  if (fuzz_io_fault(&iov[0].iov_len) == -1)
+    return -1;
+  if (iov[0].iov_len < len)
+    iov_len = 1;
+#endif
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL)
+    return tls_result(
+        ctx, SSL_write(ctx->ssl, iov[0].iov_base, (int)iov[0].iov_len));
+#endif
+#ifdef _WIN32
+  (void)iov_len;
+  return send(ctx->connect_fd, iov[0].iov_base, (int)iov[0].iov_len, 0);
+#else
+  return writev(ctx->connect_fd, iov, iov_len);
+#endif
+}
 
-  section_start = target_len;
-  target_len += status_len;
-  while (*written_len < target_len) {
-    result = send(fd, &status[*written_len - section_start],
-                  target_len - *written_len, 0);
-    if (result == -1)
-      return -1;
-    else
-      *written_len += result;
-  }
+/* Reads up to len bytes from the file, starting at offset, without moving
+ * the file's offset, which a restarted server shares with the responses a
+ * server sends after handing off, see detach_connection. Returns the bytes
+ * read, 0 on failure. */
+static size_t read_file(FILE *file, size_t offset, char *buffer, size_t len) {
+#ifdef _WIN32
+  if (fseek(file, (long)offset, SEEK_SET) != 0)
+    return 0;
+  return fread(buffer, 1, len, file);
+#else
+  ssize_t result = pread(fileno(file), buffer, len, (off_t)offset);
 
-  buf_len = snprintf(buf, sizeof buf,
-                     "\r\nConnection: close\r\nContent-Length: %ld\r\n%s\r\n",
-                     response_len, additional_headers);
-  section_start = target_len;
-  target_len += buf_len;
-  while (*written_len < target_len) {
-    result = send(fd, &buf[*written_len - section_start],
-                  target_len - *written_len, 0);
-    if (result == -1)
-      return -1;
-    else
-      *written_len += result;
+  return result == -1 ? 0 : (size_t)result;
+#endif
+}
+
+/* Sends up to len bytes from the file, starting at offset. On Linux, with
+ * plain sockets or kernel TLS, this is a sendfile(), so the bytes never visit
+ * userspace. Otherwise they are read into a buffer and sent from there. */
+static ssize_t connection_send_file(struct connection_ctx *ctx, FILE *file,
+                                    size_t offset, size_t len) {
+  char buffer[16384];
+  size_t read_len;
+#ifdef __linux__
+  off_t file_offset = offset;
+  int plain_socket = 1;
+#endif
+
+#ifdef RISKYCHAT_FUZZ
+  if (fuzz_io_fault(&len) == -1)
+    return -1;
+#endif
+#ifdef __linux__
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL) {
+    plain_socket = 0;
+    if (BIO_get_ktls_send(SSL_get_wbio(ctx->ssl)))
+      return tls_result(ctx,
+                        SSL_sendfile(ctx->ssl, fileno(file), offset, len, 0));
   }
+#endif
+  if (plain_socket)
+    return sendfile(ctx->connect_fd, fileno(file), &file_offset, len);
+#endif
 
-  if (!is_head) {
-    section_start = target_len;
-    target_len += response_len;
-    while (*written_len < target_len) {
-      result = send(fd, &response[*written_len - section_start],
-                    target_len - *written_len, 0);
-      if (result == -1)
-        return -1;
-      else
-        *written_len += result;
-    }
+  if (len > sizeof buffer)
+    len = sizeof buffer;
+  read_len = read_file(file, offset, buffer, len);
+  if (read_len == 0) {
+    errno = EIO;
+    return -1;
   }
+  return connection_send(ctx, buffer, read_len);
+}
 
-  return 0;
+/* HPACK (RFC 7541), the header compression of HTTP/2: the static table, and
+ * the length of each byte's Huffman code, and EOS's. The codes themselves are
+ * built from the lengths by build_huffman. */
+static char *hpack_static_table[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"},
+    {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"},
+    {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""}, {"content-location", ""},
+    {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+    {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+    {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}};
+static unsigned char huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, /* 0x00 */
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, /* 0x10 */
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, /* 0x20 */
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10, /* 0x30 */
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, /* 0x40 */
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6, /* 0x50 */
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, /* 0x60 */
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, /* 0x70 */
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, /* 0x80 */
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, /* 0x90 */
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, /* 0xA0 */
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23, /* 0xB0 */
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, /* 0xC0 */
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, /* 0xD0 */
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, /* 0xE0 */
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26, /* 0xF0 */
+    30 /* EOS */};
+static unsigned long huffman_codes[257];
+/* For decoding: the symbols in the order of their codes, and where the codes
+ * of each length start. */
+static short huffman_symbols[257];
+static unsigned long huffman_first_code[31];
+static int huffman_first_symbol[31];
+static int huffman_counts[31];
+
+static void put_u32(unsigned char *bytes, unsigned long x) {
+  bytes[0] = (unsigned char)(x >> 24 & 0xFF);
+  bytes[1] = (unsigned char)(x >> 16 & 0xFF);
+  bytes[2] = (unsigned char)(x >> 8 & 0xFF);
+  bytes[3] = (unsigned char)(x & 0xFF);
 }
 
-static char chat_head_raw[] = "\
-HTTP/1.1 200 OK\r\n\
-Transfer-Encoding: chunked\r\n\
-\r\n";
-static ssize_t write_chunk_length(int fd, size_t len, size_t *written_len,
-                                  size_t start) {
-  int buf_len, result;
-  char buf[16];
-  buf_len = snprintf(buf, sizeof buf, "%lx\r\n", len);
-  while (*written_len < start + buf_len) {
-    result =
-        send(fd, &buf[*written_len - start], start + buf_len - *written_len, 0);
-    if (result == -1)
-      return -1;
-    else
-      *written_len += result;
-  }
-  return buf_len;
+static unsigned long get_u32(unsigned char *bytes) {
+  return (unsigned long)bytes[0] << 24 | (unsigned long)bytes[1] << 16 |
+         (unsigned long)bytes[2] << 8 | (unsigned long)bytes[3];
 }
 
-static char chunk_terminator[] = "\r\n";
-static ssize_t write_chunk_terminator(int fd, size_t *written_len,
-                                      size_t start) {
-  int len, result;
-  len = sizeof chunk_terminator - 1;
-  while (*written_len < start + len) {
-    result = send(fd, &chunk_terminator[*written_len - start],
-                  start + len - *written_len, 0);
-    if (result == -1)
-      return -1;
-    else
-      *written_len += result;
+/* Writes the integer with an HPACK prefix of prefix_bits, after the flags in
+ * the first byte's other bits. Returns the bytes written. */
+static size_t hpack_put_integer(unsigned char *out, unsigned char flags,
+                                int prefix_bits, unsigned long value) {
+  unsigned long prefix_max = (1UL << prefix_bits) - 1;
+  size_t len = 1;
+
+  if (value < prefix_max) {
+    out[0] = (unsigned char)(flags | value);
+    return 1;
   }
+  out[0] = (unsigned char)(flags | prefix_max);
+  for (value -= prefix_max; value >= 128; value /= 128)
+    out[len++] = (unsigned char)(value % 128 + 128);
+  out[len++] = (unsigned char)value;
   return len;
 }
 
-static char post_head[] = "<post>";
-static char post_tail[] = "</post>";
-
-/* Returns 0 when the entire response has been sent.
- * This is separate from write_http_response because of the chat rendering. */
-static ssize_t write_http_chat_response(int fd, size_t *written_len,
-                                        int is_head) {
-  ssize_t result, section_start, target_len, posts_index, post_start;
+/* Writes the string, Huffman-coded if that makes it shorter. Returns the bytes
+ * written, at most len + 3 for the strings of a response. */
+static size_t hpack_put_string(unsigned char *out, char *str, size_t len) {
+  size_t bits = 0, out_len, i;
+  unsigned char byte;
+  int bit;
 
-  section_start = 0;
-  target_len = sizeof chat_head_raw - 1;
-  while (*written_len < target_len) {
-    result = send(fd, &chat_head_raw[*written_len - section_start],
-                  target_len - *written_len, 0);
-    if (result == -1)
-      return -1;
-    else
-      *written_len += result;
+  for (i = 0; i < len; i++)
+    bits += huffman_lengths[(unsigned char)str[i]];
+  if ((bits + 7) / 8 >= len) {
+    out_len = hpack_put_integer(out, 0, 7, len);
+    memcpy(&out[out_len], str, len);
+    return out_len + len;
   }
-
-  if (!is_head) {
-    /* Chunk length: 123\r\n */
-    section_start = target_len;
-    result = write_chunk_length(fd, sizeof static_response_chat_head - 1,
-                                written_len, section_start);
-    if (result == -1)
-      return -1;
-    target_len += result;
-
-    /* Chunk body: ... */
-    section_start = target_len;
-    target_len += sizeof static_response_chat_head - 1;
-    while (*written_len < target_len) {
-      result =
-          send(fd, &static_response_chat_head[*written_len - section_start],
-               target_len - *written_len, 0);
-      if (result == -1)
-        return -1;
-      else
-        *written_len += result;
+  out_len = hpack_put_integer(out, 0x80, 7, (bits + 7) / 8);
+  /* The padding is the start of EOS, which is all ones, so only the zeros
+   * need to be written. */
+  memset(&out[out_len], 0xFF, (bits + 7) / 8);
+  for (bits = 0, i = 0; i < len; i++) {
+    byte = (unsigned char)str[i];
+    for (bit = huffman_lengths[byte] - 1; bit >= 0; bit--, bits++) {
+      if ((huffman_codes[byte] >> bit & 1) == 0)
+        out[out_len + bits / 8] &= (unsigned char)~(0x80 >> bits % 8);
     }
+  }
+  return out_len + (bits + 7) / 8;
+}
 
-    /* Chunk terminator: \r\n */
-    section_start = target_len;
-    result = write_chunk_terminator(fd, written_len, section_start);
-    if (result == -1)
-      return -1;
-    target_len += result;
-
-    post_start = 0;
-    for (posts_index = post_start; posts_index <= POSTS_LEN; posts_index++) {
-      if (posts_index == POSTS_LEN ||
-          (POSTS[posts_index] == ';' && POSTS[posts_index + 1] == ';' &&
-           POSTS[posts_index + 2] == ';' && posts_index > post_start)) {
-        /* Chunk length: 123\r\n */
-        section_start = target_len;
-        result =
-            write_chunk_length(fd,
-                               posts_index - post_start + sizeof post_head - 1 +
-                                   sizeof post_tail - 1,
-                               written_len, section_start);
-        if (result == -1)
-          return -1;
-        target_len += result;
-
-        /* Post opening tag: */
-        section_start = target_len;
-        target_len += sizeof post_head - 1;
-        while (*written_len < target_len) {
-          result = send(fd, &post_head[*written_len - section_start],
-                        target_len - *written_len, 0);
-          if (result == -1)
-            return -1;
-          else
-            *written_len += result;
-        }
+/* Writes the header as an index into the static table if it has the whole
+ * header, or as a literal which is not added to the dynamic table, with the
+ * name from the static table when it's there. Returns the bytes written. */
+static size_t hpack_put_header(unsigned char *out, char *name, char *value,
+                               size_t value_len) {
+  size_t len;
+  int i, name_index = 0;
 
-        /* Write out this post: */
-        section_start = target_len;
-        target_len += posts_index - post_start;
-        while (*written_len < target_len) {
-          result = send(fd, &POSTS[*written_len - (section_start - post_start)],
-                        target_len - *written_len, 0);
-          if (result == -1)
-            return -1;
-          else
-            *written_len += result;
-        }
+  for (i = 0; i < 61; i++) {
+    if (strcmp(hpack_static_table[i][0], name) != 0)
+      continue;
+    if (strlen(hpack_static_table[i][1]) == value_len &&
+        memcmp(hpack_static_table[i][1], value, value_len) == 0)
+      return hpack_put_integer(out, 0x80, 7, i + 1);
+    if (name_index == 0)
+      name_index = i + 1;
+  }
+  len = hpack_put_integer(out, 0, 4, name_index);
+  if (name_index == 0)
+    len += hpack_put_string(&out[len], name, strlen(name));
+  return len + hpack_put_string(&out[len], value, value_len);
+}
 
-        /* Post closing tag: */
-        section_start = target_len;
-        target_len += sizeof post_tail - 1;
-        while (*written_len < target_len) {
-          result = send(fd, &post_tail[*written_len - section_start],
-                        target_len - *written_len, 0);
-          if (result == -1)
-            return -1;
-          else
-            *written_len += result;
-        }
+/* Reads an integer with an HPACK prefix of prefix_bits. Returns -1 if it is
+ * cut off, or too large to bother with. */
+static int hpack_get_integer(unsigned char **bytes, unsigned char *end,
+                             int prefix_bits, unsigned long *value) {
+  unsigned long prefix_max = (1UL << prefix_bits) - 1;
+  int shift = 0;
 
-        /* Start reading from the next post. */
-        posts_index += 3;
-        post_start = posts_index;
+  if (*bytes == end)
+    return -1;
+  *value = *(*bytes)++ & prefix_max;
+  if (*value < prefix_max)
+    return 0;
+  do {
+    if (*bytes == end || shift > 21)
+      return -1;
+    *value += (unsigned long)(**bytes & 0x7F) << shift;
+    shift += 7;
+  } while (*(*bytes)++ & 0x80);
+  return 0;
+}
 
-        /* Chunk terminator: \r\n */
-        section_start = target_len;
-        result = write_chunk_terminator(fd, written_len, section_start);
-        if (result == -1)
-          return -1;
-        target_len += result;
-      }
-    }
+/* Decodes the Huffman-coded bytes into out, which needs room for len * 8 / 5
+ * bytes, as the shortest code is 5 bits. Returns the decoded length, or -1 if
+ * the bytes are not a valid code. */
+static long huffman_decode(unsigned char *in, size_t len, char *out) {
+  unsigned long code = 0;
+  size_t bit;
+  long out_len = 0;
+  int code_len = 0, symbol;
 
-    /* Chunk length: 123\r\n */
-    section_start = target_len;
-    result = write_chunk_length(fd, sizeof static_response_chat_tail - 1,
-                                written_len, section_start);
-    if (result == -1)
-      return -1;
-    target_len += result;
-
-    /* Chunk body: ... */
-    section_start = target_len;
-    target_len += sizeof static_response_chat_tail - 1;
-    while (*written_len < target_len) {
-      result =
-          send(fd, &static_response_chat_tail[*written_len - section_start],
-               target_len - *written_len, 0);
-      if (result == -1)
-        return -1;
-      else
-        *written_len += result;
+  for (bit = 0; bit < len * 8; bit++) {
+    code = code << 1 | (in[bit / 8] >> (7 - bit % 8) & 1);
+    code_len++;
+    if (code - huffman_first_code[code_len] <
+        (unsigned long)huffman_counts[code_len]) {
+      symbol = huffman_symbols[huffman_first_symbol[code_len] +
+                               (code - huffman_first_code[code_len])];
+      if (symbol == 256)
+        return -1; /* EOS is never sent. */
+      out[out_len++] = (char)symbol;
+      code = 0;
+      code_len = 0;
+    } else if (code_len == 30) {
       return -1;
     }
+  }
+  /* The padding is the start of EOS, which is all ones, and under a byte. */
+  if (code_len > 7 || code != (1UL << code_len) - 1)
+    return -1;
+  return out_len;
+}
 
-    /* Chunk terminator: \r\n */
-    section_start = target_len;
-    result = write_chunk_terminator(fd, written_len, section_start);
-    if (result == -1)
-      return -1;
-    target_len += result;
+/* Returns a copy of the string, or NULL if there's no memory for it. */
+static char *copy_string(char *str) {
+  char *copy = malloc(strlen(str) + 1);
+  if (copy != NULL)
+    strcpy(copy, str);
+  return copy;
+}
 
-    /* Chunk length: 0\r\n */
-    section_start = target_len;
-    result = write_chunk_length(fd, 0, written_len, section_start);
-    if (result == -1)
-      return -1;
-    target_len += result;
+/* Reads an HPACK string into a new string. Returns NULL if it is invalid, or
+ * has a NUL in it, which no header may have. */
+static char *hpack_get_string(unsigned char **bytes, unsigned char *end) {
+  unsigned long len;
+  long str_len;
+  int huffman;
+  char *str;
 
-    /* Chunk terminator: \r\n */
-    section_start = target_len;
-    result = write_chunk_terminator(fd, written_len, section_start);
-    if (result == -1)
-      return -1;
-    target_len += result;
+  if (*bytes == end)
+    return NULL;
+  huffman = **bytes & 0x80;
+  if (hpack_get_integer(bytes, end, 7, &len) == -1 ||
+      len > (unsigned long)(end - *bytes))
+    return NULL;
+  str = malloc(huffman ? len * 8 / 5 + 1 : len + 1);
+  if (str == NULL)
+    return NULL;
+  if (huffman) {
+    str_len = huffman_decode(*bytes, len, str);
+  } else {
+    memcpy(str, *bytes, len);
+    str_len = (long)len;
+  }
+  *bytes += len;
+  if (str_len == -1 || memchr(str, '\0', str_len) != NULL) {
+    free(str);
+    return NULL;
+  }
+  str[str_len] = '\0';
+  return str;
+}
+
+/* Evicts the oldest entries of the dynamic table until it has room for size
+ * more bytes. */
+static void evict_hpack_entries(struct hpack_table *table, size_t size) {
+  int i;
+
+  while (table->len > 0 && table->size + size > table->max_size) {
+    i = (table->first + table->len - 1) % HPACK_ENTRIES_MAX;
+    table->size -= strlen(table->names[i]) + strlen(table->values[i]) +
+                   HPACK_ENTRY_OVERHEAD;
+    free(table->names[i]);
+    free(table->values[i]);
+    table->len--;
+  }
+}
+
+/* Adds the header to the front of the dynamic table, which takes the strings
+ * over. */
+static void add_hpack_entry(struct hpack_table *table, char *name,
+                            char *value) {
+  size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+  evict_hpack_entries(table, size);
+  if (size > table->max_size) {
+    /* Too large for the table, which is left empty. */
+    free(name);
+    free(value);
+    return;
   }
+  table->first = (table->first + HPACK_ENTRIES_MAX - 1) % HPACK_ENTRIES_MAX;
+  table->names[table->first] = name;
+  table->values[table->first] = value;
+  table->len++;
+  table->size += size;
+}
+
+/* Looks up an index into the static table, which the dynamic table follows.
+ * Returns -1 if there's no such entry. */
+static int hpack_lookup(struct hpack_table *table, unsigned long index,
+                        char **name, char **value) {
+  if (index == 0)
+    return -1;
+  if (index <= 61) {
+    *name = hpack_static_table[index - 1][0];
+    *value = hpack_static_table[index - 1][1];
+    return 0;
+  }
+  index -= 62;
+  if (index >= (unsigned long)table->len)
+    return -1;
+  index = (table->first + index) % HPACK_ENTRIES_MAX;
+  *name = table->names[index];
+  *value = table->values[index];
+  return 0;
+}
 
+static char http_head_format[] =
+    "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: %ld\r\n%s\r\n";
+
+/* Adds a segment to the end of the connection's output. For OUTPUT_FILE,
+ * data is the FILE. Returns -1 if the output is full, after freeing an
+ * OUTPUT_OWNED data. */
+static int queue_output(struct connection_ctx *ctx, void *data, size_t start,
+                        size_t end, enum output_owner owner) {
+  struct output_segment *segment;
+
+  if (ctx->output_len == OUTPUT_SEGMENTS_MAX) {
+    fprintf(stderr, "error: too many segments in a response\n");
+    if (owner == OUTPUT_OWNED)
+      free(data);
+    return -1;
+  }
+  segment = &ctx->output[ctx->output_len++];
+  segment->data = owner == OUTPUT_FILE ? NULL : data;
+  segment->file = owner == OUTPUT_FILE ? data : NULL;
+  segment->start = start;
+  segment->end = end;
+  segment->owner = owner;
   return 0;
 }
 
+/* Drops the output queued for a response which couldn't be queued whole, and
+ * turns it into a 503, queued by queue_response. */
+static void fail_response(struct connection_ctx *ctx) {
+  int i;
+
+  for (i = ctx->output_first; i < ctx->output_len; i++) {
+    if (ctx->output[i].owner == OUTPUT_OWNED)
+      free(ctx->output[i].data);
+  }
+  ctx->output_first = 0;
+  ctx->output_len = 0;
+  ctx->response = RESPONSE_503;
+}
+
+/* Writes the status and the headers as an HPACK header block, for an HTTP/2
+ * stream, into block, which needs room for H2_HEAD_LEN(headers) bytes. The
+ * block starts by setting the dynamic table's size to 0, as nothing is ever
+ * added to it, which also goes along with any size the client has set. The
+ * header names are lowercased, as HTTP/2 needs. Returns the length. */
+static size_t encode_h2_head(unsigned char *block, char *status,
+                             long content_length, char *headers) {
+  char name[32], length[24], *value, *end;
+  size_t len = 0, i;
+
+  block[len++] = 0x20;
+  len += hpack_put_header(&block[len], ":status", status, 3);
+  sprintf(length, "%ld", content_length);
+  len += hpack_put_header(&block[len], "content-length", length,
+                          strlen(length));
+  for (; headers[0] != '\0'; headers = end + 2) {
+    end = strstr(headers, "\r\n");
+    value = strchr(headers, ':');
+    for (i = 0; &headers[i] < value && i < sizeof name - 1; i++) {
+      name[i] = headers[i];
+      if ('A' <= name[i] && name[i] <= 'Z')
+        name[i] = (char)(name[i] - 'A' + 'a');
+    }
+    name[i] = '\0';
+    for (value++; *value == ' '; value++)
+      ;
+    len += hpack_put_header(&block[len], name, value, (size_t)(end - value));
+  }
+  return len;
+}
+
+/* Queues the header block of an HTTP/2 stream's response. Returns -1 if
+ * there's no memory for it. */
+static int queue_h2_head(struct connection_ctx *ctx, char *status,
+                         long content_length, char *headers) {
+  unsigned char *block = malloc(H2_HEAD_LEN(headers));
+
+  if (block == NULL) {
+    perror("error when allocating a response head");
+    return -1;
+  }
+  return queue_output(ctx, block, 0,
+                      encode_h2_head(block, status, content_length, headers),
+                      OUTPUT_OWNED);
+}
+
+/* Queues the status line and headers, with the status from static_responses
+ * and the given headers, each ending in CRLF. Returns -1 if there's no memory
+ * for them. */
+static int queue_head(struct connection_ctx *ctx, long content_length,
+                      char *headers) {
+  char *status = static_responses[ctx->response].status;
+  char *head;
+
+  if (ctx->stream_id != 0)
+    return queue_h2_head(ctx, status, content_length, headers);
+  /* The format, with room for the strings and a 64-bit length. */
+  head = malloc(sizeof http_head_format + strlen(status) + strlen(headers) +
+                20);
+  if (head == NULL) {
+    perror("error when allocating a response head");
+    return -1;
+  }
+  return queue_output(ctx, head, 0,
+                      sprintf(head, http_head_format, status, content_length,
+                              headers),
+                      OUTPUT_OWNED);
+}
+
 /* Returns 1 if the strings are equal (ignoring any whitespace), 0 if not. */
 static int eq_ignore_whitespace(char *a, char *b) {
   int counter_a = 0, counter_b = 0;
@@ -660,236 +1870,3836 @@ static int eq_ignore_case(char *a, char *b) {
   return a[counter_a] == b[counter_b];
 }
 
+/* Parses a Content-Length header value, returning -1 if it is not a valid
+ * non-negative number. */
+static long parse_content_length(char *value) {
+  char *end;
+  long length;
+
+  if (value == NULL)
+    return -1;
+  length = strtol(value, &end, 10);
+  if (end == value || length < 0)
+    return -1;
+  while (*end == ' ' || *end == '\t')
+    end++;
+  if (*end != '\r' && *end != '\n' && *end != '\0')
+    return -1;
+  return length;
+}
+
+/* The values of hexadecimal digits, indexed by character. Non-hex characters
+ * are mapped to -1. */
+static signed char hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x00 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x10 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x20 */
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1, /* 0x30 */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x40 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x50 */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x60 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x70 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x80 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0x90 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xA0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xB0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xC0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xD0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xE0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xF0 */
+};
+
+/* Returns the amount of bytes at the start of the buffer which are not '%' or
+ * '+', i.e. the bytes which decode_percent can copy over as they are. */
+static size_t count_plain_bytes(char *buffer, size_t len) {
+  size_t i = 0;
+#ifdef RISKYCHAT_SSE2
+  __m128i percents = _mm_set1_epi8('%');
+  __m128i pluses = _mm_set1_epi8('+');
+  __m128i block;
+  int mask;
+  for (; i + 16 <= len; i += 16) {
+    block = _mm_loadu_si128((__m128i *)&buffer[i]);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, percents),
+                                          _mm_cmpeq_epi8(block, pluses)));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; i++) {
+    if (buffer[i] == '%' || buffer[i] == '+')
+      break;
+  }
+  return i;
+}
+
+/* Decodes an application/x-www-form-urlencoded value in place, in a single
+ * pass: plain runs are skipped over (or moved down, once something has been
+ * decoded), '+' becomes a space, and valid %XX escapes become their byte.
+ * Invalid or truncated escapes are left as they are. The buffer is
+ * NUL-terminated at the new length. */
 void decode_percent(char *buffer, size_t *buffer_len) {
-  char tol_buf[64], c;
-  int i;
-  for (i = 0; i < *buffer_len; i++) {
-    if (buffer[i] == '+')
-      buffer[i] = ' ';
-    else if (buffer[i] == '%' && buffer[i + 1] != '\0' &&
-             buffer[i + 2] != '\0') {
-      tol_buf[0] = buffer[i + 1];
-      tol_buf[1] = buffer[i + 2];
-      tol_buf[2] = '\0';
-      c = (char)strtol(tol_buf, NULL, 16);
-      buffer[i] = c;
-      memmove(&buffer[i + 1], &buffer[i + 3], *buffer_len - (i + 3));
-      *buffer_len -= 2;
-      buffer[*buffer_len] = '\0';
+  size_t read, write, run, len;
+  int high, low;
+
+  len = *buffer_len;
+  read = 0;
+  write = 0;
+  while (read < len) {
+    run = count_plain_bytes(&buffer[read], len - read);
+    if (write != read)
+      memmove(&buffer[write], &buffer[read], run);
+    read += run;
+    write += run;
+    if (read >= len)
+      break;
+
+    if (buffer[read] == '+') {
+      buffer[write++] = ' ';
+      read++;
+      continue;
+    }
+
+    /* A '%', check for the two hex digits. */
+    high = read + 2 < len ? hex_values[(unsigned char)buffer[read + 1]] : -1;
+    low = read + 2 < len ? hex_values[(unsigned char)buffer[read + 2]] : -1;
+    if (high == -1 || low == -1) {
+      buffer[write++] = buffer[read++];
+    } else {
+      buffer[write++] = (char)(high << 4 | low);
+      read += 3;
     }
   }
+
+  *buffer_len = write;
+  buffer[write] = '\0';
 }
 
-void add_new_post(char *buffer, size_t buffer_len, int user_id) {
-  char *name;
-  int name_len;
+/* The request body limits and the form field each resource cares about,
+ * indexed by enum resource. Bodies of other resources are not read. The
+ * limits are filled in from CONFIG by allocate_tables. */
+static size_t max_body_lengths[6];
+static size_t body_buffer_len; /* The largest limit, and the NUL. */
+static char *form_keys[] = {NULL, NULL, "name", "content", NULL, NULL};
 
-  if (user_id <= 0 || user_id >= USERS_LEN) {
+/* Returns a buffer for any request body, or NULL if one could not be
+ * allocated. Released buffers are reused, so the common case does not hit
+ * malloc at all. */
+static char *acquire_body_buffer(void) {
+  if (BODY_POOL_LEN > 0)
+    return BODY_POOL[--BODY_POOL_LEN];
+  return malloc(body_buffer_len);
+}
+
+static void release_body_buffer(char *buffer) {
+  if (buffer == NULL)
     return;
-  }
+  if (BODY_POOL_LEN < CONFIG.body_pool)
+    BODY_POOL[BODY_POOL_LEN++] = buffer;
+  else
+    free(buffer);
+}
 
-  name = USERS[user_id].name;
-  name_len = strlen(name);
+/* Called when the form field ending at field_end has been read in entirety.
+ * If it is the first field with the given key, its value is decoded in place
+ * and saved as the connection's form value. */
+static void finish_form_field(struct connection_ctx *ctx, char *key,
+                              size_t field_end) {
+  size_t key_len;
 
-  /* Skip over "content=" */
-  buffer_len -= 8;
-  if (buffer_len < 0)
+  if (ctx->form_value != NULL || ctx->form_value_start == 0)
     return;
-  buffer += 8;
-
-  /* Un-percent-encode */
-  decode_percent(buffer, &buffer_len);
-
-  POSTS_LEN += sizeof "<name>[" - 1;
-  POSTS_LEN += name_len;
-  POSTS_LEN += sizeof "]: </name>" - 1;
-  POSTS_LEN += buffer_len;
-  POSTS_LEN += sizeof ";;;" - 1;
-  POSTS = realloc(POSTS, POSTS_LEN + 1);
-  if (POSTS == NULL) {
-    perror("error when expanding global post buffer");
-    exit(EXIT_FAILURE);
+  key_len = ctx->form_value_start - 1 - ctx->form_field_start;
+  if (key_len == strlen(key) &&
+      memcmp(&ctx->body[ctx->form_field_start], key, key_len) == 0) {
+    ctx->form_value = &ctx->body[ctx->form_value_start];
+    ctx->form_value_len = field_end - ctx->form_value_start;
+    decode_percent(ctx->form_value, &ctx->form_value_len);
   }
-  strcat(POSTS, "<name>[");
-  strcat(POSTS, name);
-  strcat(POSTS, "]: </name>");
-  strcat(POSTS, buffer);
-  strcat(POSTS, ";;;");
 }
 
-int add_user(char *name) {
-  time_t t;
-  int i;
+/* Parses the newly read body bytes between ctx->body_len and new_len, so the
+ * form is ready as soon as the last byte of the body arrives. */
+static void parse_form(struct connection_ctx *ctx, char *key, size_t new_len) {
+  size_t i;
 
-  if (USERS_LEN >= RISKYCHAT_MAX_USERS) {
-    return 0;
-  } else {
-    t = time(NULL);
-    for (i = 1; i < USERS_LEN; i++) {
-      if (t - USERS[i].refresh_time > RISKYCHAT_TIMEOUT) {
-        USERS[i].refresh_time = t;
-        free(USERS[i].name);
-        USERS[i].name = name;
-        return i;
-      }
-    }
-    i = USERS_LEN++;
-    USERS = realloc(USERS, sizeof USERS[0] * USERS_LEN);
-    if (USERS == NULL) {
-      perror("error when allocating users");
-      exit(EXIT_FAILURE);
+  for (i = ctx->body_len; i < new_len; i++) {
+    if (ctx->body[i] == '=' && ctx->form_value_start == 0) {
+      ctx->form_value_start = i + 1;
+    } else if (ctx->body[i] == '&') {
+      finish_form_field(ctx, key, i);
+      ctx->form_field_start = i + 1;
+      ctx->form_value_start = 0;
     }
-    USERS[i].refresh_time = t;
-    USERS[i].name = name;
-    return i;
   }
 }
 
-int is_expired_user(int user_id) {
-  if (user_id <= 0 || user_id >= USERS_LEN) {
-    return 1;
+/* Returns the value of the key in the query string, percent-decoded in place,
+ * or NULL if the key isn't there. */
+static char *find_query_value(char *query, char *key) {
+  size_t key_len = strlen(key), value_len;
+  char *field, *end;
+
+  for (field = query; field != NULL; field = end == NULL ? NULL : end + 1) {
+    end = strchr(field, '&');
+    if (strncmp(field, key, key_len) == 0 && field[key_len] == '=') {
+      if (end != NULL)
+        *end = '\0';
+      value_len = strlen(&field[key_len + 1]);
+      decode_percent(&field[key_len + 1], &value_len);
+      return &field[key_len + 1];
+    }
   }
-  return time(NULL) - USERS[user_id].refresh_time > RISKYCHAT_TIMEOUT;
+  return NULL;
 }
 
-int is_name_reserved(char *name) {
-  int i;
-  for (i = 1; i < USERS_LEN; i++) {
-    if (time(NULL) - USERS[i].refresh_time <= RISKYCHAT_TIMEOUT &&
-        strcmp(USERS[i].name, name) == 0) {
-      return 1;
+/* A multiplicative hash for the fixed-size hash tables. */
+static unsigned long hash_ulong(unsigned long x) {
+  return ((x & 0xFFFFFFFFUL) * 2654435761UL & 0xFFFFFFFFUL) >> 8;
+}
+
+/* Returns the bucket for the key, claiming one if it does not have one. A
+ * lookup only probes a few slots: when they are all taken, the bucket which
+ * has been idle for the longest is reused, as it's the closest to full. */
+static struct rate_bucket *find_rate_bucket(enum rate_key_kind kind,
+                                            unsigned long key) {
+  struct rate_bucket *bucket, *victim;
+  unsigned long i, probe;
+
+  i = hash_ulong(key ^ kind);
+  victim = NULL;
+  for (probe = 0; probe < 8; probe++) {
+    bucket = &RATE_BUCKETS[(i + probe) & (RATE_BUCKETS_LEN - 1)];
+    if (bucket->kind == kind && bucket->key == key)
+      return bucket;
+    if (bucket->kind == RATE_KEY_UNUSED) {
+      /* Buckets are never freed, so the key can't be further along. */
+      victim = bucket;
+      break;
     }
+    if (victim == NULL || bucket->refill_time < victim->refill_time)
+      victim = bucket;
   }
-  return 0;
+
+  victim->kind = kind;
+  victim->key = key;
+  victim->tokens = CONFIG.post_burst;
+  victim->refill_time = NOW;
+  return victim;
 }
 
-void refresh_user(int user_id) {
-  if (user_id > 0 && user_id < USERS_LEN) {
-    USERS[user_id].refresh_time = time(NULL);
+/* Adds the tokens accumulated since the bucket was last refilled. */
+static void refill_rate_bucket(struct rate_bucket *bucket) {
+  time_t refills = (NOW - bucket->refill_time) / CONFIG.post_refill;
+  if (refills <= 0)
+    return;
+  if (refills >= CONFIG.post_burst - bucket->tokens) {
+    bucket->tokens = CONFIG.post_burst;
+    bucket->refill_time = NOW;
+  } else {
+    bucket->tokens += refills;
+    bucket->refill_time += refills * CONFIG.post_refill;
   }
 }
 
-/* pubfuncs: Functions used in main(). */
+/* Fills the bucket up, for a new key. */
+static void reset_rate_bucket(enum rate_key_kind kind, unsigned long key) {
+  struct rate_bucket *bucket = find_rate_bucket(kind, key);
 
-static int connect_socket(char *addr, char *port) {
-  int fd;
-  struct sockaddr_in sa;
-  struct timeval timeout;
+  bucket->tokens = CONFIG.post_burst;
+  bucket->refill_time = NOW;
+}
 
-  fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (fd == INVALID_SOCKET) {
-    perror("tcp socket creation failed");
-    return -1;
+/* Returns 1 if the user or the IP has run out of posts for now, otherwise
+ * takes a token from both and returns 0. */
+static int is_rate_limited(int user_id, unsigned long ip) {
+  struct rate_bucket *user_bucket, *ip_bucket;
+
+  user_bucket = find_rate_bucket(RATE_KEY_USER, user_id);
+  ip_bucket = find_rate_bucket(RATE_KEY_IP, ip);
+  refill_rate_bucket(user_bucket);
+  refill_rate_bucket(ip_bucket);
+  if (user_bucket->tokens == 0 || ip_bucket->tokens == 0)
+    return 1;
+  user_bucket->tokens--;
+  ip_bucket->tokens--;
+  return 0;
+}
+
+/* Fills the token with random bytes, for a new session. */
+static void generate_session_token(unsigned char *token) {
+#ifdef _WIN32
+  unsigned int random;
+  int i;
+
+  for (i = 0; i < SESSION_TOKEN_LEN; i += sizeof random) {
+    if (rand_s(&random) != 0) {
+      fprintf(stderr, "error generating a session token\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(&token[i], &random, sizeof random);
+  }
+#else
+  if (fread(token, 1, SESSION_TOKEN_LEN, RANDOM_SOURCE) != SESSION_TOKEN_LEN) {
+    perror("error generating a session token");
+    exit(EXIT_FAILURE);
   }
+#endif
+}
 
-  memset(&sa, 0, sizeof sa);
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(atoi(port));
-  sa.sin_addr.s_addr = inet_addr(addr);
-  if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == SOCKET_ERROR) {
-    perror("binding to the address failed");
-    return -1;
+/* Writes the token as a nul-terminated hex string, for the cookie. */
+static void format_session_token(char *hex, unsigned char *token) {
+  static char digits[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < SESSION_TOKEN_LEN; i++) {
+    hex[2 * i] = digits[token[i] >> 4];
+    hex[2 * i + 1] = digits[token[i] & 0xF];
+  }
+  hex[2 * SESSION_TOKEN_LEN] = '\0';
+}
+
+/* Parses the hex of a riskyid cookie into the token. Returns 0 if the value
+ * doesn't start with a whole token, 1 otherwise. */
+static int parse_session_token(char *value, unsigned char *token) {
+  int i, high, low;
+
+  if (value == NULL)
+    return 0;
+  while (*value == ' ')
+    value++;
+  for (i = 0; i < SESSION_TOKEN_LEN; i++) {
+    high = hex_values[(unsigned char)*value++];
+    if (high == -1)
+      return 0;
+    low = hex_values[(unsigned char)*value++];
+    if (low == -1)
+      return 0;
+    token[i] = (unsigned char)(high << 4 | low);
   }
+  return 1;
+}
 
-  if (listen(fd, SOMAXCONN) == SOCKET_ERROR) {
-    perror("listening to the socket failed");
-    return -1;
+/* The home slot of a token in SESSIONS. The tokens are random, so their first
+ * bytes are as good as any hash. */
+static unsigned long session_slot(unsigned char *token) {
+  return ((unsigned long)token[0] | (unsigned long)token[1] << 8 |
+          (unsigned long)token[2] << 16) &
+         (SESSIONS_LEN - 1);
+}
+
+/* Returns the id of the user with the token, or 0 if there is none. */
+static int find_session(unsigned char *token) {
+  unsigned long i = session_slot(token);
+  while (SESSIONS[i] != 0) {
+    if (memcmp(USERS[SESSIONS[i]].token, token, SESSION_TOKEN_LEN) == 0)
+      return SESSIONS[i];
+    i = (i + 1) & (SESSIONS_LEN - 1);
   }
+  return 0;
+}
 
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 1;
-  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) ==
-      SOCKET_ERROR) {
-    perror("setting the socket recv timeout failed");
+static void insert_session(int user_id) {
+  unsigned long i = session_slot(USERS[user_id].token);
+  while (SESSIONS[i] != 0)
+    i = (i + 1) & (SESSIONS_LEN - 1);
+  SESSIONS[i] = user_id;
+}
+
+/* Gives the user a new token, and makes it findable. */
+static void add_session(int user_id) {
+  generate_session_token(USERS[user_id].token);
+  insert_session(user_id);
+}
+
+static void remove_session(int user_id) {
+  unsigned long i, j, home;
+
+  i = session_slot(USERS[user_id].token);
+  while (SESSIONS[i] != user_id) {
+    if (SESSIONS[i] == 0)
+      return;
+    i = (i + 1) & (SESSIONS_LEN - 1);
   }
-  if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) ==
-      SOCKET_ERROR) {
-    perror("setting the socket recv timeout failed");
+
+  /* Shift the following entries back over the removed one, like in
+   * remove_ip_connection. */
+  SESSIONS[i] = 0;
+  j = i;
+  for (;;) {
+    j = (j + 1) & (SESSIONS_LEN - 1);
+    if (SESSIONS[j] == 0)
+      break;
+    home = session_slot(USERS[SESSIONS[j]].token);
+    if (((j - home) & (SESSIONS_LEN - 1)) >= ((j - i) & (SESSIONS_LEN - 1))) {
+      SESSIONS[i] = SESSIONS[j];
+      SESSIONS[j] = 0;
+      i = j;
+    }
   }
+}
 
-  return fd;
+/* FNV-1a, for the names and the words. */
+static unsigned long hash_string(char *str) {
+  unsigned long hash = 2166136261UL;
+  while (*str != '\0') {
+    hash ^= (unsigned char)*str++;
+    hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  return hash;
 }
 
-/* Returns 0 when the connection is closed, -1 otherwise.
- * This should keep being called if the return value is -1. */
-static int handle_connection(struct connection_ctx *ctx) {
-  ssize_t result, name_len;
-  char buf[128];
-  char *token, *key, *value, *name;
+/* Feeds text to the splitter from *pos, until a word ends, which is then in
+ * splitter->word. Returns 1 if a word ended, 0 if the text ran out first, in
+ * which case the word may go on in the next piece of text. */
+static int next_word(struct word_splitter *splitter, char *text, size_t len,
+                     size_t *pos) {
+  unsigned char c;
 
-  switch (ctx->stage) {
-  case 0:
-    /* Read the status line. */
-    result = read_line(ctx->connect_fd, &ctx->buffer, &ctx->buffer_len,
-                       &ctx->read_len);
-    if (result == -1) {
-      return -1;
+  while (*pos < len) {
+    c = (unsigned char)text[(*pos)++];
+    if (splitter->in_tag) {
+      splitter->in_tag = c != '>';
+      continue;
     }
-    token = strtok(ctx->buffer, " ");
-    if (token != NULL && strcmp("GET", token) == 0) {
-      ctx->method = GET;
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("GET ");
-    } else if (token != NULL && strcmp("HEAD", token) == 0) {
-      ctx->method = HEAD;
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("HEAD ");
-    } else if (token != NULL && strcmp("POST", token) == 0) {
-      ctx->method = POST;
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("POST ");
-    } else {
-      ctx->stage = 3;
-      goto respond_400;
-    }
-    token = strtok(NULL, " ");
-    if (token != NULL && strcmp("/", token) == 0) {
-      ctx->requested_resource = RESOURCE_INDEX;
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("/ ");
-    } else if (token != NULL && strcmp("/post", token) == 0) {
-      ctx->requested_resource = RESOURCE_NEW_POST;
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("/post ");
-    } else if (token != NULL && strcmp("/login", token) == 0) {
-      ctx->requested_resource = RESOURCE_LOGIN;
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("/login ");
-    } else {
-      ctx->stage = 3;
-      goto respond_404;
+    if (c >= 'A' && c <= 'Z')
+      c = c - 'A' + 'a';
+    if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+      if (splitter->word_len < SEARCH_WORD_MAX)
+        splitter->word[splitter->word_len++] = (char)c;
+      continue;
+    }
+    splitter->in_tag = c == '<';
+    if (splitter->word_len > 0) {
+      splitter->word[splitter->word_len] = '\0';
+      splitter->word_len = 0;
+      return 1;
     }
+  }
+  return 0;
+}
 
-    /* Reset the line length after processing the statusline. */
-    ctx->read_len = 0;
-    ctx->stage++;
+/* Ends the text, returning 1 if a word was left in splitter->word. */
+static int last_word(struct word_splitter *splitter) {
+  splitter->in_tag = 0;
+  if (splitter->word_len == 0)
+    return 0;
+  splitter->word[splitter->word_len] = '\0';
+  splitter->word_len = 0;
+  return 1;
+}
 
-  case 1:
-    /* Read the headers. */
-    for (;;) {
-      result = read_line(ctx->connect_fd, &ctx->buffer, &ctx->buffer_len,
-                         &ctx->read_len);
-      if (result == -1) {
-        return -1;
-      }
+/* Returns the word's slot in the index, which has a NULL word if the word
+ * isn't in any post. The table must have been allocated. */
+static struct posting_list *find_posting_list(struct search_index *index,
+                                              char *word) {
+  unsigned long i = hash_string(word) & (index->lists_cap - 1);
+  while (index->lists[i].word != NULL && strcmp(index->lists[i].word, word))
+    i = (i + 1) & (index->lists_cap - 1);
+  return &index->lists[i];
+}
+
+/* Doubles the table once it's half full. Exits if out of memory, like
+ * add_new_post. */
+static void grow_search_index(struct search_index *index) {
+  struct posting_list *old_lists = index->lists;
+  size_t old_cap = index->lists_cap, i;
+
+  if ((index->lists_len + 1) * 2 <= index->lists_cap)
+    return;
+  index->lists_cap = old_cap == 0 ? 64 : old_cap * 2;
+  index->lists = calloc(index->lists_cap, sizeof index->lists[0]);
+  if (index->lists == NULL) {
+    perror("error when growing the search index");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < old_cap; i++) {
+    if (old_lists[i].word != NULL)
+      *find_posting_list(index, old_lists[i].word) = old_lists[i];
+  }
+  free(old_lists);
+  index->bytes += (index->lists_cap - old_cap) * sizeof index->lists[0];
+}
+
+/* Adds the post to the word's posting list, if it isn't the last one there
+ * already. Posts must be added in ascending order. */
+static void add_posting(struct search_index *index, char *word, size_t post) {
+  struct posting_list *list;
+  size_t delta, word_len;
+
+  grow_search_index(index);
+  list = find_posting_list(index, word);
+  if (list->word == NULL) {
+    word_len = strlen(word);
+    list->word = malloc(word_len + 1);
+    if (list->word == NULL) {
+      perror("error when adding a word to the search index");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(list->word, word, word_len + 1);
+    index->lists_len++;
+    index->bytes += word_len + 1;
+  } else if (list->last_post == post) {
+    return;
+  }
+
+  /* Room for the longest varint of a 64-bit delta. */
+  if (list->deltas_len + 10 > list->deltas_cap) {
+    index->bytes -= list->deltas_cap;
+    list->deltas_cap = list->deltas_cap == 0 ? 16 : list->deltas_cap * 2;
+    list->deltas = realloc(list->deltas, list->deltas_cap);
+    if (list->deltas == NULL) {
+      perror("error when growing a posting list");
+      exit(EXIT_FAILURE);
+    }
+    index->bytes += list->deltas_cap;
+  }
+  delta = list->posts_len == 0 ? post : post - list->last_post;
+  while (delta >= 0x80) {
+    list->deltas[list->deltas_len++] = (unsigned char)((delta & 0x7F) | 0x80);
+    delta >>= 7;
+  }
+  list->deltas[list->deltas_len++] = (unsigned char)delta;
+  list->last_post = post;
+  list->posts_len++;
+}
+
+/* Indexes a piece of the post's text. The pieces of a post go through the
+ * same splitter, ending with index_post_end. */
+static void index_post(struct search_index *index, size_t post,
+                       struct word_splitter *splitter, char *text,
+                       size_t len) {
+  size_t pos = 0;
+  while (next_word(splitter, text, len, &pos))
+    add_posting(index, splitter->word, post);
+}
+
+static void index_post_end(struct search_index *index, size_t post,
+                           struct word_splitter *splitter) {
+  if (last_word(splitter))
+    add_posting(index, splitter->word, post);
+}
+
+static void free_search_index(struct search_index *index) {
+  size_t i;
+
+  for (i = 0; i < index->lists_cap; i++) {
+    free(index->lists[i].word);
+    free(index->lists[i].deltas);
+  }
+  free(index->lists);
+  memset(index, 0, sizeof *index);
+}
+
+/* Indexes the room's posts from scratch, from the history file. This is
+ * needed when the posts are renumbered by compact_history, and when the
+ * history is handed over by take_over. */
+static void index_history(struct room *room) {
+  char buffer[16384];
+  struct word_splitter splitter;
+  size_t post, offset, end, len;
+
+  free_search_index(&room->index);
+  if (room->posts_first == room->posts_len)
+    return;
+  if (fseek(room->history, (long)room->post_offsets[room->posts_first],
+            SEEK_SET) != 0)
+    goto fail;
+  memset(&splitter, 0, sizeof splitter);
+  for (post = room->posts_first; post < room->posts_len; post++) {
+    end = post + 1 < room->posts_len ? room->post_offsets[post + 1]
+                                     : room->history_len;
+    for (offset = room->post_offsets[post]; offset < end; offset += len) {
+      len = end - offset;
+      if (len > sizeof buffer)
+        len = sizeof buffer;
+      if (fread(buffer, 1, len, room->history) != len)
+        goto fail;
+      index_post(&room->index, post, &splitter, buffer, len);
+    }
+    index_post_end(&room->index, post, &splitter);
+  }
+  return;
+
+fail:
+  /* The posts can still be read, just not searched. */
+  perror("error when indexing the chat history");
+}
+
+/* Moves the cursor to the next post. Returns 0 at the end of the list. */
+static int next_posting(struct posting_cursor *cursor) {
+  size_t delta = 0;
+  unsigned char byte;
+  int shift = 0;
+
+  if (cursor->pos == cursor->list->deltas_len)
+    return 0;
+  do {
+    byte = cursor->list->deltas[cursor->pos++];
+    delta |= (size_t)(byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  cursor->post += delta;
+  return 1;
+}
+
+/* Finds the posts from posts_first on which have all of the words in the
+ * query, up to SEARCH_WORDS_MAX of them. The newest SEARCH_RESULTS_MAX are
+ * stored in results, oldest first, and their count is returned. The rarest
+ * word's list is walked, and the others are skipped along to each of its
+ * posts, so no list is decoded more than once. */
+static size_t search_posts(struct search_index *index, size_t posts_first,
+                           char *query, size_t *results) {
+  struct posting_cursor cursors[SEARCH_WORDS_MAX];
+  struct word_splitter splitter;
+  struct posting_list *list;
+  size_t ring[SEARCH_RESULTS_MAX], pos = 0, matches = 0, first, i;
+  int words_len = 0, more = 1, j;
+
+  if (index->lists_len == 0)
+    return 0;
+  memset(&splitter, 0, sizeof splitter);
+  while (words_len < SEARCH_WORDS_MAX && more) {
+    more = next_word(&splitter, query, strlen(query), &pos);
+    if (!more && !last_word(&splitter))
+      break;
+    list = find_posting_list(index, splitter.word);
+    if (list->word == NULL)
+      return 0;
+    /* Sorted by length, rarest first. */
+    for (j = words_len++; j > 0 && cursors[j - 1].list->posts_len >
+                                       list->posts_len;
+         j--)
+      cursors[j] = cursors[j - 1];
+    cursors[j].list = list;
+    cursors[j].pos = 0;
+    cursors[j].post = 0;
+  }
+  if (words_len == 0)
+    return 0;
+  for (j = 1; j < words_len; j++)
+    next_posting(&cursors[j]);
+
+  while (next_posting(&cursors[0])) {
+    for (j = 1; j < words_len; j++) {
+      while (cursors[j].post < cursors[0].post) {
+        if (!next_posting(&cursors[j]))
+          goto done;
+      }
+      if (cursors[j].post != cursors[0].post)
+        break;
+    }
+    if (j == words_len && cursors[0].post >= posts_first)
+      ring[matches++ % SEARCH_RESULTS_MAX] = cursors[0].post;
+  }
+
+done:
+  /* Once the ring has wrapped around, the oldest result is after the newest
+   * one. */
+  first = matches > SEARCH_RESULTS_MAX ? matches % SEARCH_RESULTS_MAX : 0;
+  if (matches > SEARCH_RESULTS_MAX)
+    matches = SEARCH_RESULTS_MAX;
+  for (i = 0; i < matches; i++)
+    results[i] = ring[(first + i) % SEARCH_RESULTS_MAX];
+  return matches;
+}
+
+/* Moves the posts after history_start into a new file, so that the dropped
+ * ones stop taking up space. The offsets of the posts change, so this can only
+ * be done when no responses are reading the file. */
+static void compact_history(struct room *room) {
+  char buffer[16384];
+  FILE *compacted;
+  size_t offset, len, i;
+
+  compacted = tmpfile();
+  if (compacted == NULL ||
+      fseek(room->history, (long)room->history_start, SEEK_SET) != 0)
+    goto fail;
+  for (offset = room->history_start; offset < room->history_len;
+       offset += len) {
+    len = room->history_len - offset;
+    if (len > sizeof buffer)
+      len = sizeof buffer;
+    if (fread(buffer, 1, len, room->history) != len ||
+        fwrite(buffer, 1, len, compacted) != len)
+      goto fail;
+  }
+  if (fflush(compacted) != 0)
+    goto fail;
+
+  fclose(room->history);
+  room->history = compacted;
+  for (i = room->posts_first; i < room->posts_len; i++)
+    room->post_offsets[i - room->posts_first] =
+        room->post_offsets[i] - room->history_start;
+  room->posts_len -= room->posts_first;
+  room->posts_first = 0;
+  room->history_len -= room->history_start;
+  room->history_start = 0;
+  index_history(room);
+  return;
+
+fail:
+  /* The old file still works, the compaction is retried later. */
+  perror("error when compacting the chat history");
+  if (compacted != NULL)
+    fclose(compacted);
+}
+
+/* Drops the oldest posts until the rest fit in CONFIG.history_limit, always
+ * keeping the newest one, and compacts the file when it's mostly dropped. */
+static void trim_history(struct room *room) {
+  size_t limit = (size_t)CONFIG.history_limit;
+
+  if (limit == 0)
+    return;
+  while (room->posts_len - room->posts_first > 1 &&
+         room->history_len - room->history_start > limit)
+    room->history_start = room->post_offsets[++room->posts_first];
+  if (room->history_start >= limit && room->readers == 0)
+    compact_history(room);
+}
+
+void add_new_post(struct room *room, char *name, char *content,
+                  size_t content_len) {
+  struct word_splitter splitter;
+  size_t name_len, post_len, written, post;
+
+  name_len = strlen(name);
+
+  post_len = sizeof "<post><name>[" - 1;
+  post_len += name_len;
+  post_len += sizeof "]: </name>" - 1;
+  post_len += content_len;
+  post_len += sizeof "</post>" - 1;
+
+  if (room->posts_len == room->posts_cap) {
+    room->posts_cap = room->posts_cap == 0 ? 64 : room->posts_cap * 2;
+    room->post_offsets =
+        realloc(room->post_offsets,
+                room->posts_cap * sizeof room->post_offsets[0]);
+    if (room->post_offsets == NULL) {
+      perror("error when allocating post offsets");
+      exit(EXIT_FAILURE);
+    }
+  }
+  post = room->posts_len;
+  room->post_offsets[room->posts_len++] = room->history_len;
+
+  /* Responses being sent only read up to the length they started with, so
+   * appending is safe, and the history is only ever appended to. */
+  if (fseek(room->history, 0, SEEK_END) != 0) {
+    perror("error when seeking to the end of the chat history");
+    exit(EXIT_FAILURE);
+  }
+  written =
+      fwrite("<post><name>[", 1, sizeof "<post><name>[" - 1, room->history);
+  written += fwrite(name, 1, name_len, room->history);
+  written += fwrite("]: </name>", 1, sizeof "]: </name>" - 1, room->history);
+  written += fwrite(content, 1, content_len, room->history);
+  written += fwrite("</post>", 1, sizeof "</post>" - 1, room->history);
+  if (written != post_len || fflush(room->history) != 0) {
+    perror("error when appending to the chat history");
+    exit(EXIT_FAILURE);
+  }
+  room->history_len += post_len;
+
+  /* The markup around the name and the content has no words, and ends any
+   * word or tag left open in them, so this matches index_history. */
+  memset(&splitter, 0, sizeof splitter);
+  index_post(&room->index, post, &splitter, name, name_len);
+  index_post_end(&room->index, post, &splitter);
+  index_post(&room->index, post, &splitter, content, content_len);
+  index_post_end(&room->index, post, &splitter);
+  trim_history(room);
+}
+
+/* Returns the index of the name's entry in NAMES, which is 0 if no user has
+ * the name. */
+static unsigned long find_name(char *name) {
+  unsigned long i = hash_string(name) & (NAMES_LEN - 1);
+  while (NAMES[i] != 0 && strcmp(USERS[NAMES[i]].name, name) != 0)
+    i = (i + 1) & (NAMES_LEN - 1);
+  return i;
+}
+
+static void remove_name(int user_id) {
+  unsigned long i, j, home;
+
+  i = find_name(USERS[user_id].name);
+  if (NAMES[i] != user_id)
+    return;
+
+  /* Shift the following entries back over the removed one, like in
+   * remove_ip_connection. */
+  NAMES[i] = 0;
+  j = i;
+  for (;;) {
+    j = (j + 1) & (NAMES_LEN - 1);
+    if (NAMES[j] == 0)
+      break;
+    home = hash_string(USERS[NAMES[j]].name) & (NAMES_LEN - 1);
+    if (((j - home) & (NAMES_LEN - 1)) >= ((j - i) & (NAMES_LEN - 1))) {
+      NAMES[i] = NAMES[j];
+      NAMES[j] = 0;
+      i = j;
+    }
+  }
+}
+
+/* Returns 1 if the name is fine for a room: letters, digits, '-' and '_'. */
+static int is_valid_room_name(char *name, size_t name_len) {
+  size_t i;
+
+  if (name_len == 0 || name_len > ROOM_NAME_MAX)
+    return 0;
+  for (i = 0; i < name_len; i++) {
+    if (!(name[i] >= 'a' && name[i] <= 'z') &&
+        !(name[i] >= 'A' && name[i] <= 'Z') &&
+        !(name[i] >= '0' && name[i] <= '9') && name[i] != '-' &&
+        name[i] != '_')
+      return 0;
+  }
+  return 1;
+}
+
+/* Returns the index of the name's entry in ROOM_NAMES, which is 0 if there's
+ * no room with the name. */
+static unsigned long find_room_name(char *name) {
+  unsigned long i = hash_string(name) & (ROOM_NAMES_LEN - 1);
+  while (ROOM_NAMES[i] != 0 && strcmp(ROOMS[ROOM_NAMES[i]].name, name) != 0)
+    i = (i + 1) & (ROOM_NAMES_LEN - 1);
+  return i;
+}
+
+/* Returns the index of the room in ROOMS, 0 for the main room, or -1 if the
+ * room doesn't exist. */
+static int find_room(char *name) {
+  int room;
+
+  if (name[0] == '\0')
+    return 0;
+  room = ROOM_NAMES[find_room_name(name)];
+  return room != 0 ? room : -1;
+}
+
+/* Creates a room with the name, returning its index in ROOMS, or -1 if there
+ * are CONFIG.max_rooms rooms already or its history file can't be created.
+ * The room's timer is set by the post which creates it, see touch_room. */
+static int add_room(char *name) {
+  int i;
+
+  if (FREE_ROOMS != 0)
+    i = FREE_ROOMS;
+  else if (ROOMS_LEN > CONFIG.max_rooms)
+    return -1;
+  else
+    i = ROOMS_LEN;
+  ROOMS[i].history = tmpfile();
+  if (ROOMS[i].history == NULL) {
+    perror("error when creating the room's history file");
+    return -1;
+  }
+  if (i == FREE_ROOMS)
+    FREE_ROOMS = ROOMS[i].next_free;
+  else
+    ROOMS_LEN++;
+  strcpy(ROOMS[i].name, name);
+  ROOM_NAMES[find_room_name(name)] = i;
+  return i;
+}
+
+/* Returns 1 if the slot in ROOMS is free, see remove_room. */
+static int is_free_room(int room) {
+  return room > 0 && ROOMS[room].name[0] == '\0';
+}
+
+/* Returns the number of rooms, the main one included. */
+static int count_rooms(void) {
+  int i, rooms = 0;
+
+  for (i = 0; i < ROOMS_LEN; i++)
+    rooms += !is_free_room(i);
+  return rooms;
+}
+
+/* Keeps the room around for another CONFIG.room_timeout, after a post. */
+static void touch_room(int room) {
+  if (room != 0)
+    schedule_timer(&ROOM_TIMERS, room, NOW + CONFIG.room_timeout);
+}
+
+/* Removes the room, freeing its history and slot for new rooms, unless a
+ * response is still reading its history, in which case it's retried once
+ * that one has had the time to be sent. */
+static void remove_room(int room) {
+  unsigned long i, j, home;
+
+  if (ROOMS[room].readers > 0) {
+    schedule_timer(&ROOM_TIMERS, room, NOW + CONFIG.write_timeout);
+    return;
+  }
+
+  /* Shift the following entries back over the removed one, like in
+   * remove_name. */
+  i = find_room_name(ROOMS[room].name);
+  ROOM_NAMES[i] = 0;
+  j = i;
+  for (;;) {
+    j = (j + 1) & (ROOM_NAMES_LEN - 1);
+    if (ROOM_NAMES[j] == 0)
+      break;
+    home = hash_string(ROOMS[ROOM_NAMES[j]].name) & (ROOM_NAMES_LEN - 1);
+    if (((j - home) & (ROOM_NAMES_LEN - 1)) >=
+        ((j - i) & (ROOM_NAMES_LEN - 1))) {
+      ROOM_NAMES[i] = ROOM_NAMES[j];
+      ROOM_NAMES[j] = 0;
+      i = j;
+    }
+  }
+
+  fclose(ROOMS[room].history);
+  free(ROOMS[room].post_offsets);
+  free_search_index(&ROOMS[room].index);
+  memset(&ROOMS[room], 0, sizeof ROOMS[room]);
+  ROOMS[room].next_free = FREE_ROOMS;
+  FREE_ROOMS = room;
+}
+
+/* Adds a user with the name, which should not be reserved, and returns their
+ * id, or 0 if there's no room for more users. The user takes ownership of the
+ * name. The session token is generated, unless one is given for a user who
+ * logged in on another instance. */
+int add_user(char *name, unsigned char *token) {
+  int i;
+
+  if (FREE_USERS != 0) {
+    i = FREE_USERS;
+    FREE_USERS = USERS[i].next_free;
+  } else if (USERS_LEN > CONFIG.max_users) {
+    return 0;
+  } else {
+    i = USERS_LEN++;
+  }
+  USERS[i].name = name;
+  NAMES[find_name(name)] = i;
+  if (token != NULL) {
+    memcpy(USERS[i].token, token, SESSION_TOKEN_LEN);
+    insert_session(i);
+  } else {
+    add_session(i);
+  }
+  schedule_timer(&USER_TIMERS, i, NOW + CONFIG.timeout);
+  reset_rate_bucket(RATE_KEY_USER, i); /* Not the last user's. */
+  return i;
+}
+
+/* Logs the user out, freeing their name and slot for new users. */
+static void remove_user(int user_id) {
+  remove_session(user_id);
+  remove_name(user_id);
+  cancel_timer(&USER_TIMERS, user_id);
+  free(USERS[user_id].name);
+  USERS[user_id].name = NULL;
+  USERS[user_id].next_free = FREE_USERS;
+  FREE_USERS = user_id;
+}
+
+int is_expired_user(int user_id) {
+  if (user_id <= 0 || user_id >= USERS_LEN) {
+    return 1;
+  }
+  return USERS[user_id].name == NULL;
+}
+
+int is_name_reserved(char *name) { return NAMES[find_name(name)] != 0; }
+
+void refresh_user(int user_id) {
+  if (!is_expired_user(user_id)) {
+    schedule_timer(&USER_TIMERS, user_id, NOW + CONFIG.timeout);
+  }
+}
+
+static void process_index(struct connection_ctx *ctx) {
+  if (ctx->user_id == 0 || is_expired_user(ctx->user_id)) {
+    ctx->response = RESPONSE_LOGIN;
+  } else {
+    ctx->response = RESPONSE_CHAT;
+  }
+}
+
+static void process_new_post(struct connection_ctx *ctx) {
+  ctx->response = RESPONSE_REDIRECT_TO_CHAT;
+  /* Only the posts which get posted count towards the limits. */
+  if (ctx->form_value == NULL || is_expired_user(ctx->user_id))
+    return;
+  if (is_rate_limited(ctx->user_id, ctx->ip)) {
+    ctx->response = RESPONSE_429;
+    return;
+  }
+  if (ctx->room == -1)
+    ctx->room = add_room(ctx->room_name);
+  if (ctx->room == -1) {
+    ctx->response = RESPONSE_503;
+    return;
+  }
+  add_new_post(&ROOMS[ctx->room], USERS[ctx->user_id].name, ctx->form_value,
+               ctx->form_value_len);
+  touch_room(ctx->room);
+#ifndef _WIN32
+  publish_post(ctx->room_name, ctx->user_id, ctx->form_value,
+               ctx->form_value_len);
+#endif
+  refresh_user(ctx->user_id);
+}
+
+static void process_login(struct connection_ctx *ctx) {
+  char *value, *name;
+  size_t name_len;
+
+  ctx->response = RESPONSE_ADD_USER;
+  if (ctx->user_id != 0 && !is_expired_user(ctx->user_id))
+    return;
+  value = ctx->form_value != NULL ? ctx->form_value : "";
+  name_len = strlen(value);
+  if (name_len > 30) {
+    name_len = 30;
+  }
+  name = malloc(name_len + 1);
+  if (name == NULL) {
+    perror("error when allocating name");
+    ctx->response = RESPONSE_503;
+    return;
+  }
+  memcpy(name, value, name_len);
+  name[name_len] = '\0';
+  if (is_name_reserved(name)) {
+    free(name);
+    ctx->response = RESPONSE_LOGIN;
+    return;
+  }
+  ctx->user_id = add_user(name, NULL);
+  if (ctx->user_id == 0) {
+    free(name);
+    ctx->response = RESPONSE_503; /* Out of user slots. */
+    return;
+  }
+#ifndef _WIN32
+  publish_login(ctx->user_id);
+#endif
+}
+
+/* Responds with the chat page, with only the posts which have all of the
+ * words in the q parameter. */
+static void process_search(struct connection_ctx *ctx) {
+  size_t results[SEARCH_RESULTS_MAX], results_len = 0, posts_len = 0, i, end;
+  struct room *room = ctx->room != -1 ? &ROOMS[ctx->room] : NULL;
+  char *query, *posts = NULL;
+
+  if (ctx->user_id == 0 || is_expired_user(ctx->user_id)) {
+    ctx->response = RESPONSE_LOGIN;
+    return;
+  }
+  query = find_query_value(ctx->query, "q");
+  if (room != NULL && query != NULL)
+    results_len =
+        search_posts(&room->index, room->posts_first, query, results);
+
+  /* The posts are copied out, as their offsets can change after this. */
+  for (i = 0; i < results_len; i++) {
+    end = results[i] + 1 < room->posts_len ? room->post_offsets[results[i] + 1]
+                                           : room->history_len;
+    posts_len += end - room->post_offsets[results[i]];
+  }
+  if (posts_len > 0) {
+    posts = malloc(posts_len);
+    if (posts == NULL) {
+      perror("error when allocating the search results");
+      ctx->response = RESPONSE_503;
+      return;
+    }
+  }
+  for (posts_len = 0, i = 0; i < results_len; i++) {
+    end = results[i] + 1 < room->posts_len ? room->post_offsets[results[i] + 1]
+                                           : room->history_len;
+    end -= room->post_offsets[results[i]];
+    if (fseek(room->history, (long)room->post_offsets[results[i]],
+              SEEK_SET) != 0 ||
+        fread(&posts[posts_len], 1, end, room->history) != end) {
+      perror("error when reading the search results");
+      free(posts);
+      ctx->response = RESPONSE_503;
+      return;
+    }
+    posts_len += end;
+  }
+
+  ctx->response = RESPONSE_SEARCH;
+  if (queue_head(ctx,
+                 (long)(sizeof static_response_chat_head - 1 + posts_len +
+                        sizeof static_response_chat_tail - 1),
+                 "") == -1) {
+    free(posts);
+    fail_response(ctx);
+    return;
+  }
+  if (ctx->method == HEAD) {
+    free(posts);
+    return;
+  }
+  if (queue_output(ctx, static_response_chat_head, 0,
+                   sizeof static_response_chat_head - 1,
+                   OUTPUT_BORROWED) == -1) {
+    free(posts);
+    fail_response(ctx);
+    return;
+  }
+  if ((posts != NULL &&
+       queue_output(ctx, posts, 0, posts_len, OUTPUT_OWNED) == -1) ||
+      queue_output(ctx, static_response_chat_tail, 0,
+                   sizeof static_response_chat_tail - 1,
+                   OUTPUT_BORROWED) == -1)
+    fail_response(ctx);
+}
+
+static char metrics_format[] = "\
+# TYPE riskychat_users gauge\n\
+riskychat_users %ld\n\
+# TYPE riskychat_rooms gauge\n\
+riskychat_rooms %ld\n\
+# TYPE riskychat_posts gauge\n\
+riskychat_posts %ld\n\
+# TYPE riskychat_history_bytes gauge\n\
+riskychat_history_bytes %ld\n\
+# TYPE riskychat_search_index_words gauge\n\
+riskychat_search_index_words %ld\n\
+# TYPE riskychat_search_index_bytes gauge\n\
+riskychat_search_index_bytes %ld\n";
+
+/* Responds with a few numbers about the server, in the Prometheus text
+ * format. They are about the whole server, so they're not in the rooms. */
+static void process_metrics(struct connection_ctx *ctx) {
+  long users = 0, posts = 0, history_bytes = 0, words = 0, index_bytes = 0;
+  char *body;
+  int i, body_len;
+
+  if (ctx->room_name[0] != '\0') {
+    ctx->response = RESPONSE_404;
+    return;
+  }
+  for (i = 1; i < USERS_LEN; i++)
+    users += USERS[i].name != NULL;
+  for (i = 0; i < ROOMS_LEN; i++) {
+    posts += (long)(ROOMS[i].posts_len - ROOMS[i].posts_first);
+    history_bytes += (long)(ROOMS[i].history_len - ROOMS[i].history_start);
+    words += (long)ROOMS[i].index.lists_len;
+    index_bytes += (long)ROOMS[i].index.bytes;
+  }
+  /* The format, with room for six 64-bit numbers. */
+  body = malloc(sizeof metrics_format + 6 * 20);
+  if (body == NULL) {
+    perror("error when allocating the metrics");
+    ctx->response = RESPONSE_503;
+    return;
+  }
+  body_len = sprintf(body, metrics_format, users, (long)count_rooms(), posts,
+                     history_bytes, words, index_bytes);
+
+  ctx->response = RESPONSE_METRICS;
+  if (queue_head(ctx, body_len,
+                 "Content-Type: text/plain; version=0.0.4\r\n") == -1) {
+    free(body);
+    fail_response(ctx);
+  } else if (ctx->method == HEAD) {
+    free(body);
+  } else if (queue_output(ctx, body, 0, body_len, OUTPUT_OWNED) == -1) {
+    fail_response(ctx);
+  }
+}
+
+/* The routes, which are the same in every room: /r/<name> is stripped off
+ * the path before looking them up. Looked up from route_slots, which holds
+ * the index of each route plus one, 0 marking an unused slot. */
+static char *method_names[] = {"GET", "POST", "HEAD"}; /* By http_method. */
+static struct route routes[] = {
+    {"/", RESOURCE_INDEX, {process_index, NULL, process_index}},
+    {"/post", RESOURCE_NEW_POST, {NULL, process_new_post, NULL}},
+    {"/login", RESOURCE_LOGIN, {NULL, process_login, NULL}},
+    {"/search", RESOURCE_SEARCH, {process_search, NULL, process_search}},
+    {"/metrics", RESOURCE_METRICS, {process_metrics, NULL, process_metrics}},
+};
+#define ROUTE_SLOTS_LEN 16 /* A power of two, at least twice the routes. */
+static unsigned char route_slots[ROUTE_SLOTS_LEN];
+
+/* Returns the route for the path, or NULL if there's none. */
+static struct route *find_route(char *path) {
+  unsigned long i = hash_string(path) & (ROUTE_SLOTS_LEN - 1);
+  while (route_slots[i] != 0) {
+    if (strcmp(routes[route_slots[i] - 1].path, path) == 0)
+      return &routes[route_slots[i] - 1];
+    i = (i + 1) & (ROUTE_SLOTS_LEN - 1);
+  }
+  return NULL;
+}
+
+/* pubfuncs: Functions used in main(). */
+
+static char *trim_whitespace(char *str) {
+  char *end;
+
+  while (*str == ' ' || *str == '\t')
+    str++;
+  end = str + strlen(str);
+  while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' ||
+                       end[-1] == '\n'))
+    end--;
+  *end = '\0';
+  return str;
+}
+
+static struct option *find_option(char *name, size_t name_len) {
+  size_t i;
+
+  for (i = 0; i < sizeof options / sizeof options[0]; i++) {
+    if (strlen(options[i].name) == name_len &&
+        strncmp(options[i].name, name, name_len) == 0)
+      return &options[i];
+  }
+  return NULL;
+}
+
+/* Parses the value into the option's setting. Returns -1 if the value is not
+ * valid for the option. */
+static int set_option(struct option *option, char *value) {
+  char *end;
+  long number;
+
+  if (option->string != NULL) {
+    /* The defaults are literals, so only the strings from here are freed. */
+    free(option->allocated);
+    option->allocated = malloc(strlen(value) + 1);
+    if (option->allocated == NULL)
+      return -1;
+    strcpy(option->allocated, value);
+    *option->string = option->allocated;
+    return 0;
+  }
+  number = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || number < option->min)
+    return -1;
+  *option->number = number;
+  return 0;
+}
+
+/* Reads "name = value" lines into the settings, skipping blank lines and the
+ * ones starting with '#'. */
+static int read_config_file(char *path) {
+  char line[512], *name, *value;
+  int line_number;
+  struct option *option;
+  FILE *file;
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  for (line_number = 1; fgets(line, sizeof line, file) != NULL;
+       line_number++) {
+    name = trim_whitespace(line);
+    if (*name == '\0' || *name == '#')
+      continue;
+    value = strchr(name, '=');
+    if (value == NULL) {
+      option = NULL;
+    } else {
+      *value = '\0';
+      name = trim_whitespace(name);
+      value = trim_whitespace(value + 1);
+      option = find_option(name, strlen(name));
+    }
+    if (option == NULL || set_option(option, value) == -1) {
+      fprintf(stderr, "%s:%d: invalid setting\n", path, line_number);
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+/* Returns 1 and the flag's name and value if argv[*arg] is a flag, 0 if it is
+ * a positional argument, and -1 if it's a flag without a value. The value is
+ * either after a '=' or the next argument, in which case *arg is advanced. */
+static int parse_flag(int argc, char **argv, int *arg, char **name,
+                      size_t *name_len, char **value) {
+  char *equals;
+
+  if (strncmp(argv[*arg], "--", 2) != 0)
+    return 0;
+  *name = argv[*arg] + 2;
+  equals = strchr(*name, '=');
+  if (equals != NULL) {
+    *name_len = equals - *name;
+    *value = equals + 1;
+  } else if (*arg + 1 < argc) {
+    *name_len = strlen(*name);
+    *value = argv[++*arg];
+  } else {
+    return -1;
+  }
+  return 1;
+}
+
+/* Reads the settings into CONFIG: first the config file from --config or
+ * RISKYCHAT_CONFIG, then the environment variables, then the rest of the
+ * flags. The arguments which aren't flags are returned in positional, which
+ * has room for four. Returns -1 if any of the settings are invalid. */
+static int configure(int argc, char **argv, char **positional,
+                     int *positional_len) {
+  char *name, *value, *config_path;
+  size_t name_len, i;
+  int arg, result;
+  struct option *option;
+
+  config_path = getenv("RISKYCHAT_CONFIG");
+  for (arg = 1; arg < argc; arg++) {
+    result = parse_flag(argc, argv, &arg, &name, &name_len, &value);
+    if (result == -1)
+      return -1;
+    if (result == 1 && name_len == 6 && strncmp(name, "config", 6) == 0)
+      config_path = value;
+  }
+  if (config_path != NULL && read_config_file(config_path) == -1)
+    return -1;
+
+  for (i = 0; i < sizeof options / sizeof options[0]; i++) {
+    value = getenv(options[i].env);
+    if (value != NULL && set_option(&options[i], value) == -1) {
+      fprintf(stderr, "invalid %s: %s\n", options[i].env, value);
+      return -1;
+    }
+  }
+
+  *positional_len = 0;
+  for (arg = 1; arg < argc; arg++) {
+    result = parse_flag(argc, argv, &arg, &name, &name_len, &value);
+    if (result == 0) {
+      if (*positional_len == 4)
+        return -1;
+      positional[(*positional_len)++] = argv[arg];
+      continue;
+    }
+    if (name_len == 6 && strncmp(name, "config", 6) == 0)
+      continue;
+    option = find_option(name, name_len);
+    if (option == NULL || set_option(option, value) == -1) {
+      fprintf(stderr, "invalid flag: --%.*s\n", (int)name_len, name);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* The smallest power of two which fits entries with room to spare. */
+static unsigned long hash_table_len(long entries) {
+  unsigned long len = 1;
+  while (len < 2 * (unsigned long)entries)
+    len *= 2;
+  return len;
+}
+
+/* Allocates the tables sized by the settings. The user ids start from 1, as 0
+ * marks an unused entry in the hash tables. */
+static int allocate_tables(void) {
+  long i;
+
+  USERS = malloc((CONFIG.max_users + 1) * sizeof USERS[0]);
+  SESSIONS_LEN = hash_table_len(CONFIG.max_users);
+  SESSIONS = calloc(SESSIONS_LEN, sizeof SESSIONS[0]);
+  NAMES_LEN = SESSIONS_LEN;
+  NAMES = calloc(NAMES_LEN, sizeof NAMES[0]);
+  ROOMS = calloc(CONFIG.max_rooms + 1, sizeof ROOMS[0]);
+  ROOM_NAMES_LEN = hash_table_len(CONFIG.max_rooms);
+  ROOM_NAMES = calloc(ROOM_NAMES_LEN, sizeof ROOM_NAMES[0]);
+  IP_COUNTS_LEN = hash_table_len(CONFIG.max_connections);
+  IP_COUNTS = calloc(IP_COUNTS_LEN, sizeof IP_COUNTS[0]);
+  BODY_POOL = malloc((CONFIG.body_pool + 1) * sizeof BODY_POOL[0]);
+  if (USERS == NULL || SESSIONS == NULL || NAMES == NULL || ROOMS == NULL ||
+      ROOM_NAMES == NULL || IP_COUNTS == NULL || BODY_POOL == NULL)
+    return -1;
+
+  max_body_lengths[RESOURCE_LOGIN] = CONFIG.max_login_body;
+  max_body_lengths[RESOURCE_NEW_POST] = CONFIG.max_post_body;
+  body_buffer_len = CONFIG.max_login_body > CONFIG.max_post_body
+                        ? CONFIG.max_login_body + 1
+                        : CONFIG.max_post_body + 1;
+  for (i = 0; i < CONFIG.body_pool; i++) {
+    BODY_POOL[i] = malloc(body_buffer_len);
+    if (BODY_POOL[i] == NULL)
+      return -1;
+    BODY_POOL_LEN++;
+  }
+  return 0;
+}
+
+static void free_tables(void) {
+  int i;
+
+  for (i = 1; i < USERS_LEN; i++) {
+    free(USERS[i].name);
+  }
+  free(USERS);
+  free(SESSIONS);
+  free(NAMES);
+  for (i = 0; i < ROOMS_LEN; i++) {
+    if (ROOMS[i].history != NULL)
+      fclose(ROOMS[i].history);
+    free(ROOMS[i].post_offsets);
+    free_search_index(&ROOMS[i].index);
+  }
+  free(ROOMS);
+  free(ROOM_NAMES);
+  free(IP_COUNTS);
+  for (i = 0; i < BODY_POOL_LEN; i++) {
+    free(BODY_POOL[i]);
+  }
+  free(BODY_POOL);
+}
+
+static int connect_socket(char *addr, char *port) {
+  int fd;
+#ifndef _WIN32
+  int reuse = 1;
+#endif
+  struct sockaddr_in sa;
+  struct timeval timeout;
+
+  fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd == INVALID_SOCKET) {
+    perror("tcp socket creation failed");
+    return -1;
+  }
+
+#ifndef _WIN32
+  /* Let restarts bind while the old connections are in TIME_WAIT. */
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) ==
+      SOCKET_ERROR) {
+    perror("setting SO_REUSEADDR failed");
+  }
+#endif
+
+  memset(&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(atoi(port));
+  sa.sin_addr.s_addr = inet_addr(addr);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == SOCKET_ERROR) {
+    perror("binding to the address failed");
+    return -1;
+  }
+
+  if (listen(fd, (int)CONFIG.backlog) == SOCKET_ERROR) {
+    perror("listening to the socket failed");
+    return -1;
+  }
+
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) ==
+      SOCKET_ERROR) {
+    perror("setting the socket recv timeout failed");
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) ==
+      SOCKET_ERROR) {
+    perror("setting the socket recv timeout failed");
+  }
+
+  return fd;
+}
+
+#ifndef _WIN32
+static int write_snapshot(FILE *file) {
+  struct snapshot_header header;
+  struct snapshot_room room;
+  struct snapshot_user user;
+  struct snapshot_replication replication;
+  struct snapshot_peer peer;
+  int i;
+
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+  header.rooms_len = ROOMS_LEN;
+  header.users_len = USERS_LEN;
+  header.free_users = FREE_USERS;
+  header.free_rooms = FREE_ROOMS;
+  if (fwrite(&header, sizeof header, 1, file) != 1)
+    return -1;
+
+  for (i = 0; i < ROOMS_LEN; i++) {
+    memset(&room, 0, sizeof room);
+    strcpy(room.name, ROOMS[i].name);
+    room.next_free = ROOMS[i].next_free;
+    room.deadline = ROOM_TIMERS.timers[i].deadline;
+    room.history_len = ROOMS[i].history_len;
+    room.history_start = ROOMS[i].history_start;
+    room.posts_len = ROOMS[i].posts_len - ROOMS[i].posts_first;
+    if (fwrite(&room, sizeof room, 1, file) != 1)
+      return -1;
+    if (room.posts_len > 0 &&
+        fwrite(&ROOMS[i].post_offsets[ROOMS[i].posts_first],
+               sizeof ROOMS[i].post_offsets[0], room.posts_len,
+               file) != room.posts_len)
+      return -1;
+  }
+
+  for (i = 1; i < USERS_LEN; i++) {
+    memset(&user, 0, sizeof user);
+    user.next_free = USERS[i].next_free;
+    if (USERS[i].name != NULL) {
+      user.name_len = strlen(USERS[i].name) + 1;
+      user.deadline = USER_TIMERS.timers[i].deadline;
+      memcpy(user.token, USERS[i].token, SESSION_TOKEN_LEN);
+    }
+    if (fwrite(&user, sizeof user, 1, file) != 1)
+      return -1;
+    if (user.name_len > 0 &&
+        fwrite(USERS[i].name, 1, user.name_len, file) != user.name_len)
+      return -1;
+  }
+
+  if (fwrite(RATE_BUCKETS, sizeof RATE_BUCKETS, 1, file) != 1)
+    return -1;
+
+  memset(&replication, 0, sizeof replication);
+  memcpy(replication.epoch, REPLICATION_EPOCH, SESSION_TOKEN_LEN);
+  replication.events_first = EVENTS_FIRST;
+  replication.events_len = EVENTS_LEN;
+  replication.log_len = REPLICATION_LOG_LEN;
+  replication.peers_len = PEERS_LEN;
+  replication.has_listener = REPLICATION_FD != -1;
+  if (fwrite(&replication, sizeof replication, 1, file) != 1)
+    return -1;
+  if (EVENTS_LEN > EVENTS_FIRST &&
+      (fwrite(EVENT_OFFSETS, sizeof EVENT_OFFSETS[0], EVENTS_LEN - EVENTS_FIRST,
+              file) != EVENTS_LEN - EVENTS_FIRST ||
+       fwrite(REPLICATION_LOG, 1, REPLICATION_LOG_LEN, file) !=
+           REPLICATION_LOG_LEN))
+    return -1;
+  for (i = 0; i < PEERS_LEN; i++) {
+    memset(&peer, 0, sizeof peer);
+    peer.address_len = strlen(PEERS[i].address);
+    memcpy(peer.epoch, PEERS[i].epoch, SESSION_TOKEN_LEN);
+    peer.next_seq = PEERS[i].next_seq;
+    if (fwrite(&peer, sizeof peer, 1, file) != 1 ||
+        fwrite(PEERS[i].address, 1, peer.address_len, file) !=
+            peer.address_len)
+      return -1;
+  }
+  return fflush(file) == 0 ? 0 : -1;
+}
+
+/* Restores the state written by write_snapshot into the freshly allocated
+ * tables, setting up the hash tables and timers along the way. The peers are
+ * matched by their addresses, so the list can change between restarts. */
+static int read_snapshot(FILE *file, int *has_listener) {
+  struct snapshot_header header;
+  struct snapshot_room room;
+  struct snapshot_user user;
+  struct snapshot_replication replication;
+  struct snapshot_peer peer;
+  char address[512];
+  int i, j;
+
+  if (fread(&header, sizeof header, 1, file) != 1 ||
+      memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) != 0)
+    return -1;
+  if (header.rooms_len < 1 || header.rooms_len > CONFIG.max_rooms + 1) {
+    fprintf(stderr, "the running server has more rooms than max-rooms\n");
+    return -1;
+  }
+  if (header.users_len < 1 || header.users_len > CONFIG.max_users + 1) {
+    fprintf(stderr, "the running server has more users than max-users\n");
+    return -1;
+  }
+
+  /* The history files are received after this, see take_over. */
+  for (i = 0; i < header.rooms_len; i++) {
+    if (fread(&room, sizeof room, 1, file) != 1 ||
+        room.name[ROOM_NAME_MAX] != '\0')
+      return -1;
+    ROOMS_LEN = i + 1;
+    if (i > 0 && room.name[0] == '\0') {
+      ROOMS[i].next_free = room.next_free;
+      continue;
+    }
+    ROOMS[i].posts_cap = room.posts_len > 64 ? room.posts_len : 64;
+    ROOMS[i].post_offsets =
+        malloc(ROOMS[i].posts_cap * sizeof ROOMS[i].post_offsets[0]);
+    if (ROOMS[i].post_offsets == NULL ||
+        fread(ROOMS[i].post_offsets, sizeof ROOMS[i].post_offsets[0],
+              room.posts_len, file) != room.posts_len)
+      return -1;
+    strcpy(ROOMS[i].name, room.name);
+    ROOMS[i].posts_len = room.posts_len;
+    ROOMS[i].history_len = room.history_len;
+    ROOMS[i].history_start = room.history_start;
+    if (i > 0) {
+      ROOM_NAMES[find_room_name(room.name)] = i;
+      schedule_timer(&ROOM_TIMERS, i, room.deadline);
+    }
+  }
+  FREE_ROOMS = header.free_rooms;
+
+  for (i = 1; i < header.users_len; i++) {
+    if (fread(&user, sizeof user, 1, file) != 1)
+      return -1;
+    USERS[i].next_free = user.next_free;
+    USERS[i].name = NULL;
+    USERS_LEN = i + 1;
+    if (user.name_len == 0)
+      continue;
+    USERS[i].name = malloc(user.name_len);
+    if (USERS[i].name == NULL ||
+        fread(USERS[i].name, 1, user.name_len, file) != user.name_len ||
+        USERS[i].name[user.name_len - 1] != '\0')
+      return -1;
+    memcpy(USERS[i].token, user.token, SESSION_TOKEN_LEN);
+    insert_session(i);
+    NAMES[find_name(USERS[i].name)] = i;
+    schedule_timer(&USER_TIMERS, i, user.deadline);
+  }
+  FREE_USERS = header.free_users;
+
+  if (fread(RATE_BUCKETS, sizeof RATE_BUCKETS, 1, file) != 1)
+    return -1;
+
+  if (fread(&replication, sizeof replication, 1, file) != 1)
+    return -1;
+  memcpy(REPLICATION_EPOCH, replication.epoch, SESSION_TOKEN_LEN);
+  if (replication.events_first > replication.events_len)
+    return -1;
+  EVENTS_FIRST = replication.events_first;
+  EVENTS_LEN = replication.events_len;
+  if (EVENTS_LEN > EVENTS_FIRST) {
+    EVENTS_CAP = EVENTS_LEN - EVENTS_FIRST;
+    EVENT_OFFSETS = malloc(EVENTS_CAP * sizeof EVENT_OFFSETS[0]);
+    REPLICATION_LOG = malloc(replication.log_len);
+    if (EVENT_OFFSETS == NULL || REPLICATION_LOG == NULL ||
+        fread(EVENT_OFFSETS, sizeof EVENT_OFFSETS[0], EVENTS_CAP, file) !=
+            EVENTS_CAP ||
+        fread(REPLICATION_LOG, 1, replication.log_len, file) !=
+            replication.log_len)
+      return -1;
+    REPLICATION_LOG_LEN = REPLICATION_LOG_CAP = replication.log_len;
+  }
+  for (i = 0; i < replication.peers_len; i++) {
+    if (fread(&peer, sizeof peer, 1, file) != 1 ||
+        peer.address_len >= sizeof address ||
+        fread(address, 1, peer.address_len, file) != peer.address_len)
+      return -1;
+    address[peer.address_len] = '\0';
+    for (j = 0; j < PEERS_LEN; j++) {
+      if (strcmp(PEERS[j].address, address) == 0) {
+        memcpy(PEERS[j].epoch, peer.epoch, SESSION_TOKEN_LEN);
+        PEERS[j].next_seq = peer.next_seq;
+      }
+    }
+  }
+  *has_listener = replication.has_listener;
+  return 0;
+}
+
+static int control_socket_address(struct sockaddr_un *sa) {
+  if (strlen(CONFIG.control_socket) >= sizeof sa->sun_path) {
+    fprintf(stderr, "the control socket path is too long\n");
+    return -1;
+  }
+  memset(sa, 0, sizeof *sa);
+  sa->sun_family = AF_UNIX;
+  strcpy(sa->sun_path, CONFIG.control_socket);
+  return 0;
+}
+
+/* Sends the descriptors over the control connection, HANDOFF_FDS_MAX at a
+ * time, each batch attached to a single byte. */
+static int send_fds(int fd, int *fds, int fds_len) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  int batch_len;
+  char byte = 'r';
+
+  while (fds_len > 0) {
+    batch_len = fds_len < HANDOFF_FDS_MAX ? fds_len : HANDOFF_FDS_MAX;
+    memset(&msg, 0, sizeof msg);
+    memset(&control, 0, sizeof control);
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(batch_len * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(batch_len * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, batch_len * sizeof(int));
+    if (sendmsg(fd, &msg, 0) != 1)
+      return -1;
+    fds += batch_len;
+    fds_len -= batch_len;
+  }
+  return 0;
+}
+
+/* Receives descriptors sent with send_fds, which must be sending exactly
+ * fds_len of them. */
+static int recv_fds(int fd, int *fds, int fds_len) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(HANDOFF_FDS_MAX * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  int batch_len;
+  char byte;
+
+  while (fds_len > 0) {
+    batch_len = fds_len < HANDOFF_FDS_MAX ? fds_len : HANDOFF_FDS_MAX;
+    memset(&msg, 0, sizeof msg);
+    memset(&control, 0, sizeof control);
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    if (recvmsg(fd, &msg, 0) != 1)
+      return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(batch_len * sizeof(int)))
+      return -1;
+    memcpy(fds, CMSG_DATA(cmsg), batch_len * sizeof(int));
+    fds += batch_len;
+    fds_len -= batch_len;
+  }
+  return 0;
+}
+
+/* Sets the 1 microsecond timeouts which turn the socket's calls into polls,
+ * like on the listening socket. */
+static void set_socket_polling(int fd) {
+  struct timeval timeout;
+
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+}
+
+/* Sets the timeouts of the control connection, which the other server
+ * answers right away on. */
+static void set_control_timeouts(int fd) {
+  struct timeval timeout;
+
+  timeout.tv_sec = 10;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+}
+
+/* Connects to the control socket of a running server, which hands over its
+ * listening socket right away, and the rooms' history files and the rest of
+ * its state once none of its connections is in the middle of a request, see
+ * finish_take_over and hand_off. That takes at most a header and a body
+ * timeout. Returns the listening socket, -1 if there's no server running,
+ * or -2 if the take over failed. */
+static int take_over(void) {
+  struct sockaddr_un sa;
+  int fd, listen_fd;
+
+  if (control_socket_address(&sa) == -1)
+    return -2;
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+    close(fd);
+    return -1;
+  }
+  printf("Taking over from the running server...\n");
+  fflush(stdout);
+
+  /* On failure, exiting closes the connection, and the running server goes
+   * on as if nothing happened. */
+  set_control_timeouts(fd);
+  if (recv_fds(fd, &listen_fd, 1) == -1) {
+    fprintf(stderr, "error receiving the listening socket\n");
+    return -2;
+  }
+  set_socket_polling(fd);
+  TAKEOVER_FD = fd;
+  TAKEOVER_DEADLINE = NOW + CONFIG.header_timeout + CONFIG.body_timeout + 1;
+  return listen_fd;
+}
+
+/* Receives the running server's state, once it sends it. Until then, the
+ * requests wait before being processed. Returns 0 once taken over, 1 if
+ * still waiting, or -1 if the take over failed. */
+static int finish_take_over(void) {
+  int fd = TAKEOVER_FD, snapshot_fd, *history_fds, has_listener, rooms, i, j;
+  ssize_t result;
+  char byte;
+  size_t history_len;
+  FILE *snapshot;
+
+  result = recv(fd, &byte, 1, MSG_PEEK);
+  if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+      NOW < TAKEOVER_DEADLINE)
+    return 1;
+  if (result != 1) {
+    fprintf(stderr, "the running server did not hand its state off\n");
+    return -1;
+  }
+  set_control_timeouts(fd);
+  if (recv_fds(fd, &snapshot_fd, 1) == -1) {
+    fprintf(stderr, "error receiving the hand off\n");
+    return -1;
+  }
+  snapshot = fdopen(snapshot_fd, "rb");
+  if (snapshot == NULL || fseek(snapshot, 0, SEEK_SET) != 0 ||
+      read_snapshot(snapshot, &has_listener) == -1) {
+    fprintf(stderr, "error reading the running server's state\n");
+    return -1;
+  }
+  fclose(snapshot);
+
+  /* The listening replication socket comes after the history files. */
+  rooms = count_rooms();
+  history_fds = malloc((rooms + 1) * sizeof history_fds[0]);
+  if (history_fds == NULL ||
+      recv_fds(fd, history_fds, rooms + has_listener) == -1) {
+    fprintf(stderr, "error receiving the rooms' history files\n");
+    return -1;
+  }
+  if (has_listener)
+    REPLICATION_FD = history_fds[rooms];
+  history_len = 0;
+  for (i = j = 0; i < ROOMS_LEN; i++) {
+    if (is_free_room(i))
+      continue;
+    ROOMS[i].history = fdopen(history_fds[j++], "r+b");
+    if (ROOMS[i].history == NULL) {
+      perror("error opening a room's history file");
+      return -1;
+    }
+    history_len += ROOMS[i].history_len - ROOMS[i].history_start;
+  }
+  free(history_fds);
+
+  byte = 'y';
+  if (send(fd, &byte, 1, 0) != 1) {
+    perror("error acknowledging the hand off");
+    return -1;
+  }
+  close(fd);
+  TAKEOVER_FD = -1;
+  /* The index isn't in the snapshot, it's faster to rebuild it. */
+  for (i = 0; i < ROOMS_LEN; i++) {
+    if (!is_free_room(i))
+      index_history(&ROOMS[i]);
+  }
+  printf("Took over with %d rooms, %ld bytes of history and %d users.\n",
+         rooms, (long)history_len, USERS_LEN - 1);
+  return 0;
+}
+
+/* Listens on the control socket for restarted servers, see hand_off. */
+static int listen_control_socket(void) {
+  struct sockaddr_un sa;
+  struct timeval timeout;
+
+  if (control_socket_address(&sa) == -1)
+    return -1;
+  /* Left behind by the server which was taken over, or one which crashed. */
+  unlink(CONFIG.control_socket);
+  CONTROL_FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (CONTROL_FD == -1 ||
+      bind(CONTROL_FD, (struct sockaddr *)&sa, sizeof sa) == -1 ||
+      listen(CONTROL_FD, 1) == -1) {
+    perror("error listening on the control socket");
+    return -1;
+  }
+  /* Polled like the listening socket. */
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 1;
+  if (setsockopt(CONTROL_FD, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof timeout) == -1) {
+    perror("setting the control socket recv timeout failed");
+  }
+  return 0;
+}
+
+/* Starts listening on the control and replication sockets, once the state is
+ * this server's, which is after the take over when restarting. */
+static int listen_after_start(void) {
+  if (CONFIG.control_socket[0] != '\0' && listen_control_socket() == -1)
+    return -1;
+  if (CONFIG.replicate_listen[0] == '\0' && REPLICATION_FD != -1) {
+    /* Replication was turned off for this restart. */
+    close(REPLICATION_FD);
+    REPLICATION_FD = -1;
+  } else if (CONFIG.replicate_listen[0] != '\0' && REPLICATION_FD == -1 &&
+             listen_replication() == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Sends the listening socket to the restarted server on HANDOFF_FD, which
+ * accepts the connections from then on. */
+static int offer_listener(int listen_fd) {
+  set_control_timeouts(HANDOFF_FD);
+  if (send_fds(HANDOFF_FD, &listen_fd, 1) == -1)
+    return -1;
+  set_socket_polling(HANDOFF_FD);
+  return 0;
+}
+
+/* Returns 1 if the restarted server has gone away before the hand off. */
+static int handoff_abandoned(void) {
+  ssize_t result;
+  char byte;
+
+  result = recv(HANDOFF_FD, &byte, 1, MSG_PEEK);
+  return result == 0 ||
+         (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/* Returns 1 if the connection is in the middle of a request, which can't
+ * be processed after the hand off. HTTP/2 connections get no new streams
+ * after their GOAWAY. */
+static int needs_state(struct connection_ctx *ctx) {
+  int i;
+
+  if (ctx->h2 == NULL)
+    return ctx->stage < 4;
+  if (!ctx->h2->goaway)
+    return 1;
+  for (i = 0; i < H2_STREAMS_MAX; i++) {
+    if (ctx->h2->streams[i].id != 0 && ctx->h2->streams[i].ctx.stage != 4)
+      return 1;
+  }
+  return 0;
+}
+
+/* Sends a snapshot of the state, the rooms' history files and the listening
+ * replication socket to the restarted server on HANDOFF_FD. Returns 0 once
+ * it has taken over, -1 if it didn't. */
+static int hand_off(void) {
+  int snapshot_fd, *history_fds, rooms, i, result;
+  char byte;
+  FILE *snapshot;
+
+  set_control_timeouts(HANDOFF_FD);
+  snapshot = tmpfile();
+  history_fds = malloc((ROOMS_LEN + 1) * sizeof history_fds[0]);
+  if (snapshot == NULL || history_fds == NULL ||
+      write_snapshot(snapshot) == -1) {
+    perror("error writing the snapshot for the restarted server");
+    if (snapshot != NULL)
+      fclose(snapshot);
+    free(history_fds);
+    return -1;
+  }
+  snapshot_fd = fileno(snapshot);
+  for (rooms = i = 0; i < ROOMS_LEN; i++) {
+    if (!is_free_room(i))
+      history_fds[rooms++] = fileno(ROOMS[i].history);
+  }
+  history_fds[rooms] = REPLICATION_FD;
+
+  result = -1;
+  if (send_fds(HANDOFF_FD, &snapshot_fd, 1) == 0 &&
+      send_fds(HANDOFF_FD, history_fds,
+               rooms + (REPLICATION_FD != -1)) == 0 &&
+      recv(HANDOFF_FD, &byte, 1, 0) == 1 && byte == 'y')
+    result = 0;
+  fclose(snapshot);
+  free(history_fds);
+  if (result == 0)
+    printf("Handed off, sending the last responses.\n");
+  return result;
+}
+
+/* Lets go of the rooms after the hand off, which are the restarted server's
+ * now. The responses left only read the history files, with pread, which
+ * doesn't move the offset they share with the restarted server. */
+static void detach_connection(struct connection_ctx *ctx) {
+  int i;
+
+  ctx->room = -1;
+  for (i = 0; ctx->h2 != NULL && i < H2_STREAMS_MAX; i++)
+    ctx->h2->streams[i].ctx.room = -1;
+}
+
+/* Parses a replicate-listen or peers address into sa: a unix socket path if
+ * there's a '/' in it, host:port otherwise. Returns the length of the
+ * address, or 0 if it's invalid. */
+static socklen_t replication_address(char *address,
+                                     struct sockaddr_storage *sa) {
+  struct sockaddr_in *in = (struct sockaddr_in *)sa;
+  struct sockaddr_un *un = (struct sockaddr_un *)sa;
+  char host[16], *colon;
+
+  memset(sa, 0, sizeof *sa);
+  if (strchr(address, '/') != NULL) {
+    if (strlen(address) >= sizeof un->sun_path)
+      return 0;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    return sizeof *un;
+  }
+  colon = strrchr(address, ':');
+  if (colon == NULL || (size_t)(colon - address) >= sizeof host ||
+      atoi(colon + 1) <= 0)
+    return 0;
+  memcpy(host, address, colon - address);
+  host[colon - address] = '\0';
+  in->sin_family = AF_INET;
+  in->sin_port = htons(atoi(colon + 1));
+  in->sin_addr.s_addr = inet_addr(host);
+  if (in->sin_addr.s_addr == INADDR_NONE)
+    return 0;
+  return sizeof *in;
+}
+
+/* Sets up the peers from CONFIG.peers, and a new epoch for the log, which
+ * take_over replaces with the running server's. */
+static int init_replication(void) {
+  struct sockaddr_storage sa;
+  char *start, *end;
+  int peers_cap;
+
+  /* The followers would take a longer post's event as invalid, and keep
+   * reconnecting to get it. */
+  if (CONFIG.replicate_listen[0] != '\0' &&
+      (unsigned long)CONFIG.max_post_body > REPLICATION_POST_MAX) {
+    fprintf(stderr, "max-post-body can be at most %lu with replicate-listen\n",
+            REPLICATION_POST_MAX);
+    return -1;
+  }
+  generate_session_token(REPLICATION_EPOCH);
+  peers_cap = 1;
+  for (start = CONFIG.peers; *start != '\0'; start++)
+    peers_cap += *start == ',';
+  PEERS = calloc(peers_cap, sizeof PEERS[0]);
+  if (PEERS == NULL) {
+    perror("error allocating peers");
+    return -1;
+  }
+  PEERS_LEN = 0;
+  for (start = CONFIG.peers; *start != '\0'; start = end) {
+    end = start + strcspn(start, ",");
+    if (end == start) {
+      end++;
+      continue;
+    }
+    PEERS[PEERS_LEN].address = malloc(end - start + 1);
+    if (PEERS[PEERS_LEN].address == NULL) {
+      perror("error allocating peers");
+      return -1;
+    }
+    memcpy(PEERS[PEERS_LEN].address, start, end - start);
+    PEERS[PEERS_LEN].address[end - start] = '\0';
+    PEERS[PEERS_LEN].fd = -1;
+    PEERS[PEERS_LEN].retry_delay = 1;
+    if (replication_address(PEERS[PEERS_LEN++].address, &sa) == 0) {
+      fprintf(stderr, "invalid peer address: %.*s\n", (int)(end - start),
+              start);
+      return -1;
+    }
+    if (*end == ',')
+      end++;
+  }
+  return 0;
+}
+
+/* Listens on CONFIG.replicate_listen for the other instances. */
+static int listen_replication(void) {
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  int reuse = 1;
+
+  sa_len = replication_address(CONFIG.replicate_listen, &sa);
+  if (sa_len == 0) {
+    fprintf(stderr, "invalid replicate-listen address\n");
+    return -1;
+  }
+  /* Left behind by a server which crashed, like the control socket. */
+  if (sa.ss_family == AF_UNIX)
+    unlink(CONFIG.replicate_listen);
+  REPLICATION_FD = socket(sa.ss_family, SOCK_STREAM, 0);
+  if (REPLICATION_FD == -1) {
+    perror("error creating the replication socket");
+    return -1;
+  }
+  if (sa.ss_family == AF_INET)
+    setsockopt(REPLICATION_FD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+  if (bind(REPLICATION_FD, (struct sockaddr *)&sa, sa_len) == -1 ||
+      listen(REPLICATION_FD, FOLLOWERS_MAX) == -1) {
+    perror("error listening on the replication socket");
+    return -1;
+  }
+  set_socket_polling(REPLICATION_FD);
+  return 0;
+}
+
+static void append_log(void *data, size_t len) {
+  if (REPLICATION_LOG_LEN + len > REPLICATION_LOG_CAP) {
+    if (REPLICATION_LOG_CAP == 0)
+      REPLICATION_LOG_CAP = 16384;
+    while (REPLICATION_LOG_LEN + len > REPLICATION_LOG_CAP)
+      REPLICATION_LOG_CAP *= 2;
+    REPLICATION_LOG = realloc(REPLICATION_LOG, REPLICATION_LOG_CAP);
+    if (REPLICATION_LOG == NULL) {
+      perror("error when allocating the replication log");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(&REPLICATION_LOG[REPLICATION_LOG_LEN], data, len);
+  REPLICATION_LOG_LEN += len;
+}
+
+/* Appends the string with a length byte, it should be short enough. */
+static void append_log_string(char *str) {
+  unsigned char len = (unsigned char)strlen(str);
+
+  append_log(&len, 1);
+  append_log(str, len);
+}
+
+/* Starts an event in the log, with its length filled in by end_event. */
+static void begin_event(unsigned char type) {
+  unsigned char header[5] = {0};
+
+  if (EVENTS_LEN - EVENTS_FIRST == EVENTS_CAP) {
+    EVENTS_CAP = EVENTS_CAP == 0 ? 64 : EVENTS_CAP * 2;
+    EVENT_OFFSETS =
+        realloc(EVENT_OFFSETS, EVENTS_CAP * sizeof EVENT_OFFSETS[0]);
+    if (EVENT_OFFSETS == NULL) {
+      perror("error when allocating event offsets");
+      exit(EXIT_FAILURE);
+    }
+  }
+  EVENT_OFFSETS[EVENTS_LEN++ - EVENTS_FIRST] = REPLICATION_LOG_LEN;
+  header[0] = type;
+  append_log(header, sizeof header);
+}
+
+static void end_event(void) {
+  size_t start = EVENT_OFFSETS[EVENTS_LEN - 1 - EVENTS_FIRST];
+
+  put_u32(&REPLICATION_LOG[start + 1], REPLICATION_LOG_LEN - start - 5);
+}
+
+static void publish_login(int user_id) {
+  if (CONFIG.replicate_listen[0] == '\0')
+    return;
+  begin_event('L');
+  append_log(USERS[user_id].token, SESSION_TOKEN_LEN);
+  append_log_string(USERS[user_id].name);
+  end_event();
+}
+
+static void publish_post(char *room_name, int user_id, char *content,
+                         size_t content_len) {
+  if (CONFIG.replicate_listen[0] == '\0')
+    return;
+  begin_event('P');
+  append_log(USERS[user_id].token, SESSION_TOKEN_LEN);
+  append_log_string(USERS[user_id].name);
+  append_log_string(room_name);
+  append_log(content, content_len);
+  end_event();
+}
+
+/* Where the event starts in the log, which has to have it or be up to it. */
+static size_t event_offset(unsigned long seq) {
+  return seq < EVENTS_LEN ? EVENT_OFFSETS[seq - EVENTS_FIRST]
+                          : REPLICATION_LOG_LEN;
+}
+
+/* Finds the follower by its epoch, or makes room for it in place of one
+ * which has been forgotten. Returns -1 if there's no room. */
+static int find_known_follower(unsigned char *epoch) {
+  int i, forgotten = -1;
+
+  for (i = 0; i < KNOWN_FOLLOWERS_LEN; i++) {
+    if (memcmp(KNOWN_FOLLOWERS[i].epoch, epoch, SESSION_TOKEN_LEN) == 0)
+      return i;
+    if (NOW - KNOWN_FOLLOWERS[i].seen > CONFIG.timeout)
+      forgotten = i;
+  }
+  if (forgotten == -1) {
+    if (KNOWN_FOLLOWERS_LEN == FOLLOWERS_MAX)
+      return -1;
+    forgotten = KNOWN_FOLLOWERS_LEN++;
+  }
+  memcpy(KNOWN_FOLLOWERS[forgotten].epoch, epoch, SESSION_TOKEN_LEN);
+  return forgotten;
+}
+
+/* Writes an 'R' event for every user logged in into follower->resync.
+ * Returns -1 if it couldn't be allocated. */
+static int build_resync(struct follower *follower) {
+  size_t len = 0, name_len;
+  unsigned char *bytes;
+  int i;
+
+  for (i = 1; i < USERS_LEN; i++)
+    if (!is_expired_user(i))
+      len += 5 + SESSION_TOKEN_LEN + 1 + strlen(USERS[i].name);
+  if (len == 0)
+    return 0;
+  follower->resync = bytes = malloc(len);
+  if (bytes == NULL)
+    return -1;
+  for (i = 1; i < USERS_LEN; i++) {
+    if (is_expired_user(i))
+      continue;
+    name_len = strlen(USERS[i].name);
+    bytes[0] = 'R';
+    put_u32(&bytes[1], SESSION_TOKEN_LEN + 1 + name_len);
+    memcpy(&bytes[5], USERS[i].token, SESSION_TOKEN_LEN);
+    bytes[5 + SESSION_TOKEN_LEN] = (unsigned char)name_len;
+    memcpy(&bytes[5 + SESSION_TOKEN_LEN + 1], USERS[i].name, name_len);
+    bytes += 5 + SESSION_TOKEN_LEN + 1 + name_len;
+  }
+  follower->resync_len = len;
+  return 0;
+}
+
+/* Reads the follower's request, and then sends it the log from the event it
+ * asked for, or resyncs it, while reading its acknowledgements. Returns -1 if
+ * the follower should be dropped. */
+static int poll_follower(struct follower *follower) {
+  unsigned char reply[REPLICATION_HELLO_LEN];
+  unsigned long seq;
+  ssize_t result;
+
+  if (!follower->streaming) {
+    result = recv(follower->fd, &follower->request[follower->request_len],
+                  REPLICATION_REQUEST_LEN - follower->request_len, 0);
+    if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return NOW < follower->deadline ? 0 : -1;
+    if (result <= 0)
+      return -1;
+    follower->request_len += result;
+    if (follower->request_len < REPLICATION_REQUEST_LEN)
+      return 0;
+
+    seq = get_u32(&follower->request[SESSION_TOKEN_LEN]);
+    if (memcmp(follower->request, REPLICATION_EPOCH, SESSION_TOKEN_LEN) != 0 ||
+        seq < EVENTS_FIRST || seq > EVENTS_LEN) {
+      seq = EVENTS_FIRST;
+      /* If nothing has been dropped, the log has all the logins anyway. */
+      if (seq > 0 && build_resync(follower) == -1)
+        return -1;
+    }
+    memcpy(reply, REPLICATION_EPOCH, SESSION_TOKEN_LEN);
+    put_u32(&reply[SESSION_TOKEN_LEN], seq);
+    /* Nothing has been sent yet, so this fits in the socket's buffer. */
+    if (send(follower->fd, reply, sizeof reply, 0) != sizeof reply)
+      return -1;
+    follower->streaming = 1;
+    follower->deadline = NOW + CONFIG.write_timeout;
+    follower->sent = event_offset(seq);
+    follower->known =
+        find_known_follower(&follower->request[REPLICATION_HELLO_LEN]);
+    if (follower->known != -1)
+      KNOWN_FOLLOWERS[follower->known].acked = seq;
+  }
+  if (follower->known != -1)
+    KNOWN_FOLLOWERS[follower->known].seen = NOW;
+
+  while ((result = recv(follower->fd, &follower->ack[follower->ack_len],
+                        sizeof follower->ack - follower->ack_len, 0)) > 0) {
+    follower->ack_len += result;
+    if (follower->ack_len < sizeof follower->ack)
+      continue;
+    follower->ack_len = 0;
+    seq = get_u32(follower->ack);
+    if (follower->known != -1 && seq <= EVENTS_LEN)
+      KNOWN_FOLLOWERS[follower->known].acked = seq;
+  }
+  if (result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    return -1;
+
+  if (follower->resync != NULL) {
+    result = send(follower->fd, &follower->resync[follower->resync_sent],
+                  follower->resync_len - follower->resync_sent, 0);
+    if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (result > 0)
+      follower->resync_sent += result;
+    if (follower->resync_sent < follower->resync_len)
+      return NOW < follower->deadline ? 0 : -1;
+    free(follower->resync);
+    follower->resync = NULL;
+  }
+  if (follower->sent < REPLICATION_LOG_LEN) {
+    result = send(follower->fd, &REPLICATION_LOG[follower->sent],
+                  REPLICATION_LOG_LEN - follower->sent, 0);
+    if (result == -1)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    follower->sent += result;
+  }
+  return 0;
+}
+
+static void drop_follower(int i) {
+  close(FOLLOWERS[i].fd);
+  free(FOLLOWERS[i].resync);
+  FOLLOWERS[i] = FOLLOWERS[--FOLLOWERS_LEN];
+}
+
+/* Drops the start of the log which every follower not yet forgotten has
+ * acknowledged, and whatever else goes over CONFIG.history_limit, like
+ * trim_history. Followers which were sent the log up to before the dropped
+ * events, and so have fallen behind, are disconnected, and resynced when
+ * they're back. */
+static void trim_log(void) {
+  unsigned long first = EVENTS_LEN, i;
+  size_t drop, limit = (size_t)CONFIG.history_limit;
+  int j, followed = 0, over_limit = 0;
+
+  /* A follower being resynced is sent the log from its start once the
+   * resync is written, within the write timeout, so that stays until then. */
+  for (j = 0; j < FOLLOWERS_LEN; j++)
+    if (FOLLOWERS[j].resync != NULL)
+      return;
+  for (j = 0; j < KNOWN_FOLLOWERS_LEN; j++) {
+    if (NOW - KNOWN_FOLLOWERS[j].seen > CONFIG.timeout ||
+        KNOWN_FOLLOWERS[j].acked < EVENTS_FIRST)
+      continue;
+    followed = 1;
+    if (KNOWN_FOLLOWERS[j].acked < first)
+      first = KNOWN_FOLLOWERS[j].acked;
+  }
+  /* Without followers, the log is kept for the first ones. */
+  if (!followed)
+    first = EVENTS_FIRST;
+  while (limit > 0 && first < EVENTS_LEN &&
+         REPLICATION_LOG_LEN - event_offset(first) > limit) {
+    first++;
+    over_limit = 1;
+  }
+  drop = event_offset(first);
+  /* Otherwise only moved once it's half of the log, to keep it cheap. */
+  if (drop == 0 || (!over_limit && drop < REPLICATION_LOG_LEN / 2))
+    return;
+
+  memmove(REPLICATION_LOG, &REPLICATION_LOG[drop], REPLICATION_LOG_LEN - drop);
+  REPLICATION_LOG_LEN -= drop;
+  memmove(EVENT_OFFSETS, &EVENT_OFFSETS[first - EVENTS_FIRST],
+          (EVENTS_LEN - first) * sizeof EVENT_OFFSETS[0]);
+  for (i = 0; i < EVENTS_LEN - first; i++)
+    EVENT_OFFSETS[i] -= drop;
+  EVENTS_FIRST = first;
+  for (j = 0; j < FOLLOWERS_LEN; j++) {
+    if (!FOLLOWERS[j].streaming)
+      continue;
+    if (FOLLOWERS[j].sent < drop)
+      drop_follower(j--);
+    else
+      FOLLOWERS[j].sent -= drop;
+  }
+}
+
+static void disconnect_peer(struct peer *peer) {
+  close(peer->fd);
+  peer->fd = -1;
+  peer->connecting = 0;
+  peer->streaming = 0;
+  peer->buffer_len = 0;
+  peer->retry_at = NOW + peer->retry_delay;
+  if (peer->retry_delay < 16)
+    peer->retry_delay *= 2;
+}
+
+/* Starts connecting to the peer, without waiting for it, see
+ * finish_connect_peer. */
+static void connect_peer(struct peer *peer) {
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+
+  sa_len = replication_address(peer->address, &sa);
+  peer->fd = socket(sa.ss_family, SOCK_STREAM, 0);
+  if (peer->fd == -1) {
+    perror("error creating a replication socket");
+    peer->retry_at = NOW + peer->retry_delay;
+    return;
+  }
+  fcntl(peer->fd, F_SETFL, O_NONBLOCK);
+  peer->connecting = 1;
+  peer->retry_at = NOW + CONFIG.header_timeout;
+  if (connect(peer->fd, (struct sockaddr *)&sa, sa_len) == -1 &&
+      errno != EINPROGRESS)
+    disconnect_peer(peer);
+}
+
+/* Checks on the connect started by connect_peer, and once it's done, asks
+ * for the events after the ones applied already. Returns -1 if it failed. */
+static int finish_connect_peer(struct peer *peer) {
+  struct sockaddr_storage sa;
+  socklen_t sa_len = sizeof sa;
+  int error = 0;
+  socklen_t error_len = sizeof error;
+  unsigned char request[REPLICATION_REQUEST_LEN];
+
+  if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 ||
+      error != 0)
+    return -1;
+  /* Still connecting if there's no error, but no address either. */
+  if (getpeername(peer->fd, (struct sockaddr *)&sa, &sa_len) == -1)
+    return errno == ENOTCONN && NOW < peer->retry_at ? 0 : -1;
+  peer->connecting = 0;
+  memcpy(request, peer->epoch, SESSION_TOKEN_LEN);
+  put_u32(&request[SESSION_TOKEN_LEN], peer->next_seq);
+  memcpy(&request[REPLICATION_HELLO_LEN], REPLICATION_EPOCH, SESSION_TOKEN_LEN);
+  /* Nothing has been sent yet, so this fits in the socket's buffer. */
+  return send(peer->fd, request, sizeof request, 0) == sizeof request ? 0
+                                                                       : -1;
+}
+
+/* Reads a string with a length byte from the event at *bytes into str, which
+ * has room for max bytes and the NUL. Returns -1 if it doesn't fit. */
+static int read_event_string(unsigned char **bytes, unsigned char *end,
+                             char *str, size_t max) {
+  size_t len;
+
+  if (*bytes >= end)
+    return -1;
+  len = **bytes;
+  if (len > max || (size_t)(end - *bytes - 1) < len)
+    return -1;
+  memcpy(str, *bytes + 1, len);
+  str[len] = '\0';
+  *bytes += 1 + len;
+  return strlen(str) == len ? 0 : -1;
+}
+
+/* Applies an event from a peer's log, between bytes and end. Returns -1 if
+ * it's malformed. */
+static int apply_event(unsigned char type, unsigned char *bytes,
+                       unsigned char *end) {
+  unsigned char token[SESSION_TOKEN_LEN];
+  char name[31], room_name[ROOM_NAME_MAX + 1], *name_copy;
+  int user_id, room;
+
+  if (end - bytes < SESSION_TOKEN_LEN)
+    return -1;
+  memcpy(token, bytes, SESSION_TOKEN_LEN);
+  bytes += SESSION_TOKEN_LEN;
+  if (read_event_string(&bytes, end, name, sizeof name - 1) == -1)
+    return -1;
+  user_id = find_session(token);
+
+  if (type == 'L' || type == 'R') {
+    if (bytes != end)
+      return -1;
+    /* If the name was taken here first, the user stays on their instance. */
+    if (user_id != 0 || is_name_reserved(name))
+      return 0;
+    name_copy = malloc(strlen(name) + 1);
+    if (name_copy == NULL) {
+      perror("error when allocating name");
+      return 0;
+    }
+    strcpy(name_copy, name);
+    if (add_user(name_copy, token) == 0) {
+      fprintf(stderr, "out of user slots for a peer's user\n");
+      free(name_copy);
+    }
+    return 0;
+  }
+
+  if (type == 'P') {
+    if (read_event_string(&bytes, end, room_name, ROOM_NAME_MAX) == -1 ||
+        (room_name[0] != '\0' &&
+         !is_valid_room_name(room_name, strlen(room_name))))
+      return -1;
+    /* A user whose login was dropped, as the name was taken here first,
+     * doesn't get to post under it here either. Users who only expired here
+     * keep their name, unless someone else has taken it since. */
+    if (user_id == 0 && is_name_reserved(name))
+      return 0;
+    refresh_user(user_id);
+    room = find_room(room_name);
+    if (room == -1)
+      room = add_room(room_name);
+    if (room == -1) {
+      fprintf(stderr, "out of rooms for a peer's post\n");
+      return 0;
+    }
+    add_new_post(&ROOMS[room], name, (char *)bytes, end - bytes);
+    touch_room(room);
+    return 0;
+  }
+  return -1;
+}
+
+/* Reads the peer's reply and events as they come, applying the whole ones. */
+static void poll_peer(struct peer *peer) {
+  ssize_t result;
+  size_t start, event_len;
+  unsigned char *event, ack[4];
+  unsigned long applied_seq;
+
+  if (peer->fd == -1) {
+    if (NOW >= peer->retry_at)
+      connect_peer(peer);
+    return;
+  }
+  if (peer->connecting) {
+    if (finish_connect_peer(peer) == -1)
+      disconnect_peer(peer);
+    return;
+  }
+
+  if (peer->buffer_len == peer->buffer_cap) {
+    peer->buffer_cap = peer->buffer_cap == 0 ? 16384 : peer->buffer_cap * 2;
+    peer->buffer = realloc(peer->buffer, peer->buffer_cap);
+    if (peer->buffer == NULL) {
+      perror("error when allocating a peer's buffer");
+      exit(EXIT_FAILURE);
+    }
+  }
+  result = recv(peer->fd, &peer->buffer[peer->buffer_len],
+                peer->buffer_cap - peer->buffer_len, 0);
+  if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (result <= 0) {
+    if (CONFIG.verbose >= 1)
+      printf("lost the replication connection to %s\n", peer->address);
+    disconnect_peer(peer);
+    return;
+  }
+  peer->buffer_len += result;
+
+  start = 0;
+  if (!peer->streaming) {
+    if (peer->buffer_len < REPLICATION_HELLO_LEN)
+      return;
+    memcpy(peer->epoch, peer->buffer, SESSION_TOKEN_LEN);
+    peer->next_seq = get_u32(&peer->buffer[SESSION_TOKEN_LEN]);
+    peer->streaming = 1;
+    peer->retry_delay = 1;
+    start = REPLICATION_HELLO_LEN;
+    if (CONFIG.verbose >= 1)
+      printf("following %s from event %lu\n", peer->address, peer->next_seq);
+  }
+  applied_seq = peer->next_seq;
+  while (peer->buffer_len - start >= 5) {
+    event = &peer->buffer[start];
+    event_len = get_u32(&event[1]);
+    if (event_len > REPLICATION_EVENT_MAX)
+      goto invalid;
+    if (peer->buffer_len - start - 5 < event_len)
+      break;
+    if (apply_event(event[0], &event[5], &event[5 + event_len]) == -1)
+      goto invalid;
+    if (event[0] != 'R')
+      peer->next_seq++;
+    start += 5 + event_len;
+  }
+  memmove(peer->buffer, &peer->buffer[start], peer->buffer_len - start);
+  peer->buffer_len -= start;
+
+  if (peer->next_seq != applied_seq) {
+    put_u32(ack, peer->next_seq);
+    result = send(peer->fd, ack, sizeof ack, 0);
+    /* With the socket's buffer full, the next one acknowledges these too. */
+    if (result != sizeof ack &&
+        (result != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)))
+      disconnect_peer(peer);
+  }
+  return;
+
+invalid:
+  fprintf(stderr, "invalid replication event from %s\n", peer->address);
+  disconnect_peer(peer);
+}
+
+/* Accepts new followers, sends them the log, and applies the peers' events.
+ * Called once per loop. */
+static void poll_replication(void) {
+  int fd, i;
+
+  while (REPLICATION_FD != -1 && FOLLOWERS_LEN < FOLLOWERS_MAX &&
+         (fd = accept(REPLICATION_FD, NULL, NULL)) != -1) {
+    set_socket_polling(fd);
+    memset(&FOLLOWERS[FOLLOWERS_LEN], 0, sizeof FOLLOWERS[FOLLOWERS_LEN]);
+    FOLLOWERS[FOLLOWERS_LEN].fd = fd;
+    FOLLOWERS[FOLLOWERS_LEN].deadline = NOW + CONFIG.header_timeout;
+    FOLLOWERS_LEN++;
+  }
+  for (i = 0; i < FOLLOWERS_LEN; i++)
+    if (poll_follower(&FOLLOWERS[i]) == -1)
+      drop_follower(i--);
+  trim_log();
+  for (i = 0; i < PEERS_LEN; i++)
+    poll_peer(&PEERS[i]);
+}
+
+static void free_replication(int handed_off) {
+  int i;
+
+  for (i = 0; i < FOLLOWERS_LEN; i++) {
+    close(FOLLOWERS[i].fd);
+    free(FOLLOWERS[i].resync);
+  }
+  for (i = 0; i < PEERS_LEN; i++) {
+    if (PEERS[i].fd != -1)
+      close(PEERS[i].fd);
+    free(PEERS[i].address);
+    free(PEERS[i].buffer);
+  }
+  free(PEERS);
+  free(REPLICATION_LOG);
+  free(EVENT_OFFSETS);
+  if (REPLICATION_FD != -1) {
+    close(REPLICATION_FD);
+    /* After a hand off, the socket belongs to the new server. */
+    if (!handed_off && strchr(CONFIG.replicate_listen, '/') != NULL)
+      unlink(CONFIG.replicate_listen);
+  }
+}
+#endif
+
+/* Queues the chat page. The posts are sent straight from the history file,
+ * as far as it went when the response was queued, so the Content-Length
+ * stays correct, and the history file is not compacted until the response
+ * is done. Returns -1 if it couldn't be queued. */
+static int queue_chat_response(struct connection_ctx *ctx, int is_head) {
+  size_t history_start = 0, history_len = 0;
+
+  if (ctx->room != -1) {
+    history_start = ROOMS[ctx->room].history_start;
+    history_len = ROOMS[ctx->room].history_len - history_start;
+  }
+  if (queue_head(ctx,
+                 (long)(sizeof static_response_chat_head - 1 + history_len +
+                        sizeof static_response_chat_tail - 1),
+                 "") == -1)
+    return -1;
+  if (!is_head &&
+      (queue_output(ctx, static_response_chat_head, 0,
+                    sizeof static_response_chat_head - 1,
+                    OUTPUT_BORROWED) == -1 ||
+       (history_len > 0 &&
+        queue_output(ctx, ROOMS[ctx->room].history, history_start,
+                     history_start + history_len, OUTPUT_FILE) == -1) ||
+       queue_output(ctx, static_response_chat_tail, 0,
+                    sizeof static_response_chat_tail - 1,
+                    OUTPUT_BORROWED) == -1))
+    return -1;
+  /* Only counted once queued, as free_request only counts down for chat
+   * responses, which a failed one isn't. */
+  if (ctx->room != -1)
+    ROOMS[ctx->room].readers++;
+  return 0;
+}
+
+/* Queues one of the static_responses. For HTTP/2, the 503's header block is
+ * encoded once into a static buffer, so it can be sent after an allocation
+ * fails, like the raw responses of HTTP/1.1. Returns -1 if it couldn't be
+ * queued. */
+static int queue_static_response(struct connection_ctx *ctx) {
+  static unsigned char h2_head_503[128];
+  static size_t h2_head_503_len = 0;
+  struct static_response *response = &static_responses[ctx->response];
+  int is_head = ctx->method == HEAD;
+
+  if (ctx->stream_id == 0)
+    return queue_output(ctx, response->raw, 0,
+                        is_head ? response->head_len : response->raw_len,
+                        OUTPUT_BORROWED);
+  if (ctx->response != RESPONSE_503) {
+    if (queue_head(ctx, (long)response->body_len, response->headers) == -1)
+      return -1;
+  } else {
+    if (h2_head_503_len == 0)
+      h2_head_503_len = encode_h2_head(h2_head_503, response->status,
+                                       (long)response->body_len,
+                                       response->headers);
+    if (queue_output(ctx, h2_head_503, 0, h2_head_503_len,
+                     OUTPUT_BORROWED) == -1)
+      return -1;
+  }
+  if (!is_head && response->body_len > 0)
+    return queue_output(ctx, response->body, 0, response->body_len,
+                        OUTPUT_BORROWED);
+  return 0;
+}
+
+/* Queues the response picked for the request, to be sent by flush_output.
+ * If it can't be queued, a 503 is sent instead. */
+static void queue_response(struct connection_ctx *ctx) {
+  char headers[128], token_hex[2 * SESSION_TOKEN_LEN + 1];
+  int result = 0;
+
+  switch (ctx->response) {
+  case RESPONSE_REDIRECT_TO_ROOM:
+    sprintf(headers, "Location: /r/%s/\r\n", ctx->room_name);
+    result = queue_head(ctx, 0, headers);
+    break;
+  case RESPONSE_ADD_USER:
+    format_session_token(token_hex, USERS[ctx->user_id].token);
+    sprintf(headers,
+            "Location: ./\r\nSet-Cookie: riskyid=%s; Path=/; HttpOnly\r\n",
+            token_hex);
+    result = queue_head(ctx, 0, headers);
+    break;
+  case RESPONSE_CHAT:
+    result = queue_chat_response(ctx, ctx->method == HEAD);
+    break;
+  case RESPONSE_SEARCH:
+  case RESPONSE_METRICS:
+    break; /* Queued by the handler. */
+  default:
+    result = queue_static_response(ctx);
+  }
+  if (result == -1) {
+    fail_response(ctx);
+    queue_static_response(ctx);
+  }
+}
+
+/* Moves past the len bytes of output which have been sent, freeing the owned
+ * segments which are done. */
+static void consume_output(struct connection_ctx *ctx, size_t len) {
+  struct output_segment *segment;
+  size_t segment_len;
+
+  for (; ctx->output_first < ctx->output_len; ctx->output_first++) {
+    segment = &ctx->output[ctx->output_first];
+    segment_len = segment->end - segment->start;
+    if (len < segment_len) {
+      segment->start += len;
+      break;
+    }
+    len -= segment_len;
+    segment->start = segment->end;
+    if (segment->owner == OUTPUT_OWNED)
+      free(segment->data);
+  }
+}
+
+/* Sends the queued output, picking up where the last call stopped. The
+ * memory segments between files are gathered into one send. Returns 0 when
+ * everything has been sent. */
+static ssize_t flush_output(struct connection_ctx *ctx) {
+  struct iovec iov[OUTPUT_SEGMENTS_MAX];
+  struct output_segment *segment;
+  ssize_t result;
+  int i;
+
+  while (ctx->output_first < ctx->output_len) {
+    segment = &ctx->output[ctx->output_first];
+    if (segment->owner == OUTPUT_FILE) {
+      result = connection_send_file(ctx, segment->file, segment->start,
+                                    segment->end - segment->start);
+    } else {
+      for (i = 0; ctx->output_first + i < ctx->output_len &&
+                  segment[i].owner != OUTPUT_FILE;
+           i++) {
+        iov[i].iov_base = &segment[i].data[segment[i].start];
+        iov[i].iov_len = segment[i].end - segment[i].start;
+      }
+      result = connection_sendv(ctx, iov, i);
+    }
+    if (result == -1)
+      return -1;
+    consume_output(ctx, (size_t)result);
+  }
+  return 0;
+}
+
+/* Looks up the route for the request target, after splitting off the query
+ * and the room. Returns -1, with the response picked, if the request can be
+ * responded to right away. */
+static int route_request(struct connection_ctx *ctx, char *target) {
+  size_t name_len;
+  char *query;
+
+  if (target == NULL || target[0] != '/') {
+    ctx->response = RESPONSE_404;
+    return -1;
+  }
+  if (CONFIG.verbose >= 2)
+    printf("%s ", target);
+  /* The query is kept for the handlers, the buffer is reused for the
+   * headers. */
+  query = strchr(target, '?');
+  if (query != NULL) {
+    *query++ = '\0';
+    ctx->query = malloc(strlen(query) + 1);
+    if (ctx->query == NULL) {
+      perror("error when allocating the query");
+      ctx->response = RESPONSE_503;
+      return -1;
+    }
+    strcpy(ctx->query, query);
+  }
+  /* The rooms have the same resources as the main room, under /r/<name>/,
+   * and the pages only link to them relatively. */
+  if (strncmp("/r/", target, 3) == 0) {
+    target += 3;
+    name_len = strcspn(target, "/");
+    if (!is_valid_room_name(target, name_len)) {
+      ctx->response = RESPONSE_404;
+      return -1;
+    }
+    memcpy(ctx->room_name, target, name_len);
+    ctx->room_name[name_len] = '\0';
+    target += name_len;
+    if (target[0] == '\0') {
+      ctx->response = RESPONSE_REDIRECT_TO_ROOM;
+      return -1;
+    }
+  }
+  ctx->route = find_route(target);
+  if (ctx->route == NULL) {
+    ctx->response = RESPONSE_404;
+    return -1;
+  }
+  return 0;
+}
+
+/* Looks for the riskyid cookie in a Cookie header's value. */
+static void parse_cookie(struct connection_ctx *ctx, char *value) {
+  char *key = strtok(value, "=");
+
+  while (key != NULL) {
+    value = strtok(NULL, ";");
+    if (eq_ignore_whitespace("riskyid", key)) {
+      ctx->has_session_token = parse_session_token(value, ctx->session_token);
+      break;
+    }
+    key = strtok(NULL, "=");
+  }
+}
+
+/* Processes the request, once it has been read, and picks the response. */
+static void process_request(struct connection_ctx *ctx) {
+  ctx->response = RESPONSE_400;
+  if (ctx->has_session_token)
+    ctx->user_id = find_session(ctx->session_token);
+  ctx->room = find_room(ctx->room_name);
+  if (ctx->route->handlers[ctx->method] != NULL)
+    ctx->route->handlers[ctx->method](ctx);
+}
+
+/* Frees what the request and its response hold, but leaves the socket. */
+static void free_request(struct connection_ctx *ctx) {
+  int i;
+
+  free(ctx->buffer);
+  free(ctx->query);
+  release_body_buffer(ctx->body);
+  for (i = ctx->output_first; i < ctx->output_len; i++) {
+    if (ctx->output[i].owner == OUTPUT_OWNED)
+      free(ctx->output[i].data);
+  }
+  if (ctx->stage == 4 && ctx->response == RESPONSE_CHAT && ctx->room != -1 &&
+      --ROOMS[ctx->room].readers == 0) {
+    /* Compact the history if it was waiting for this. */
+    trim_history(&ROOMS[ctx->room]);
+  }
+}
+
+/* The client's preface, which a PRI request line starts, and the response to
+ * an upgrade, after which the server's preface, a SETTINGS frame, follows. */
+static char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static char h2_preface_line[] = "PRI * HTTP/2.0\r\n";
+static char h2_switching_protocols[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                       "Connection: Upgrade\r\n"
+                                       "Upgrade: h2c\r\n\r\n";
+
+/* Returns 1 if the last socket call failed only because it would block. */
+static int would_block(void) {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Adds a frame header to the output, and returns where its payload goes. */
+static unsigned char *put_h2_frame(struct h2_connection *h2, size_t len,
+                                   int type, int flags,
+                                   unsigned long stream_id) {
+  unsigned char *frame = &h2->out[h2->out_len];
+
+  frame[0] = (unsigned char)(len >> 16 & 0xFF);
+  frame[1] = (unsigned char)(len >> 8 & 0xFF);
+  frame[2] = (unsigned char)(len & 0xFF);
+  frame[3] = (unsigned char)type;
+  frame[4] = (unsigned char)flags;
+  put_u32(&frame[5], stream_id);
+  h2->out_len += H2_FRAME_HEADER_LEN + len;
+  return &frame[H2_FRAME_HEADER_LEN];
+}
+
+/* Adds a RST_STREAM or a WINDOW_UPDATE frame, which have a 4-byte payload. */
+static void put_h2_u32_frame(struct h2_connection *h2, int type,
+                             unsigned long stream_id, unsigned long value) {
+  put_u32(put_h2_frame(h2, 4, type, 0, stream_id), value);
+}
+
+/* Sends GOAWAY, after which no new streams are taken. */
+static void put_h2_goaway(struct h2_connection *h2, enum h2_error error) {
+  unsigned char *payload = put_h2_frame(h2, 8, H2_GOAWAY, 0, 0);
+
+  put_u32(payload, h2->last_stream_id);
+  put_u32(&payload[4], error);
+  h2->goaway = 1;
+}
+
+/* Sends GOAWAY with the error, and closes the connection once the output has
+ * been sent. */
+static void close_h2(struct h2_connection *h2, enum h2_error error) {
+  if (h2->closing)
+    return;
+  put_h2_goaway(h2, error);
+  h2->closing = 1;
+}
+
+/* Sets up the HTTP/2 state of the connection. Returns -1 if there's no memory
+ * for it. */
+static int create_h2(struct connection_ctx *ctx) {
+  struct h2_connection *h2 = malloc(sizeof *h2);
+
+  if (h2 == NULL) {
+    perror("error when allocating an HTTP/2 connection");
+    return -1;
+  }
+  memset(h2, 0, sizeof *h2);
+  h2->header_block_cap = 256;
+  h2->header_block = malloc(h2->header_block_cap);
+  if (h2->header_block == NULL) {
+    perror("error when allocating a header block buffer");
+    free(h2);
+    return -1;
+  }
+  h2->decoder.max_size = HPACK_TABLE_SIZE;
+  h2->window = 65535;
+  h2->initial_window = 65535;
+  ctx->h2 = h2;
+  return 0;
+}
+
+/* Switches the connection to HTTP/2, with preface_left bytes of the client's
+ * preface to come, and sends the server's. */
+static void start_h2(struct connection_ctx *ctx, size_t preface_left) {
+  unsigned char *settings;
+
+  ctx->stage = 5;
+  ctx->deadline = NOW + CONFIG.header_timeout;
+  ctx->h2->idle_deadline = ctx->deadline;
+  ctx->h2->preface_left = preface_left;
+  settings = put_h2_frame(ctx->h2, 6, H2_SETTINGS, 0, 0);
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  put_u32(&settings[2], H2_STREAMS_MAX);
+}
+
+/* Frees the stream's slot. A connection left without streams gets as long
+ * as a new one has for its request, however many frames it sends. */
+static void release_h2_stream(struct h2_connection *h2,
+                              struct h2_stream *stream) {
+  free_request(&stream->ctx);
+  stream->id = 0;
+  if (--h2->streams_len == 0)
+    h2->idle_deadline = NOW + CONFIG.header_timeout;
+}
+
+static void free_h2(struct h2_connection *h2) {
+  int i;
+
+  for (i = 0; i < H2_STREAMS_MAX; i++) {
+    if (h2->streams[i].id != 0)
+      release_h2_stream(h2, &h2->streams[i]);
+  }
+  h2->decoder.max_size = 0;
+  evict_hpack_entries(&h2->decoder, 0);
+  free(h2->header_block);
+  free(h2);
+}
+
+/* Applies the client's settings. Returns the error if one is invalid. */
+static enum h2_error apply_h2_settings(struct h2_connection *h2,
+                                       unsigned char *settings, size_t len) {
+  unsigned long value;
+  long delta;
+  size_t i;
+  int j;
+
+  for (i = 0; i + 6 <= len; i += 6) {
+    value = get_u32(&settings[i + 2]);
+    switch (settings[i] << 8 | settings[i + 1]) {
+    case H2_SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+      /* Applies to the open streams too. */
+      if (value > (unsigned long)H2_WINDOW_MAX)
+        return H2_FLOW_CONTROL_ERROR;
+      delta = (long)value - h2->initial_window;
+      for (j = 0; j < H2_STREAMS_MAX; j++) {
+        if (h2->streams[j].id == 0)
+          continue;
+        if (delta > 0 && h2->streams[j].window > H2_WINDOW_MAX - delta)
+          return H2_FLOW_CONTROL_ERROR;
+        h2->streams[j].window += delta;
+      }
+      h2->initial_window = (long)value;
+      break;
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      /* The frames sent are never over the minimum, so only checked. */
+      if (value < H2_FRAME_MAX || value > 0xFFFFFFUL)
+        return H2_PROTOCOL_ERROR;
+      break;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+/* Decodes the base64url (RFC 4648) of HTTP2-Settings. Returns the decoded
+ * length, or -1 if the value is invalid or longer than out_len. */
+static long decode_base64url(char *in, unsigned char *out, size_t out_len) {
+  static char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  unsigned long bits = 0;
+  int bits_len = 0;
+  size_t len = 0;
+  char *digit;
+
+  for (; *in != '\0' && *in != '='; in++) {
+    digit = strchr(digits, *in);
+    if (digit == NULL)
+      return -1;
+    bits = (bits << 6 | (unsigned long)(digit - digits)) & 0xFFFFFF;
+    bits_len += 6;
+    if (bits_len >= 8) {
+      if (len == out_len)
+        return -1;
+      bits_len -= 8;
+      out[len++] = (unsigned char)(bits >> bits_len & 0xFF);
+    }
+  }
+  return (long)len;
+}
+
+/* Notes the headers of a request asking to upgrade to h2c. The connection is
+ * upgraded once the request has been read, see upgrade_h2, if it had both an
+ * Upgrade header with h2c and an HTTP2-Settings header. Nothing is allocated
+ * for HTTP/2 before then. */
+static void read_upgrade_header(struct connection_ctx *ctx, char *name,
+                                char *value) {
+  char *token;
+  long len;
+
+  if (value == NULL || (!eq_ignore_case("Upgrade", name) &&
+                        !eq_ignore_case("HTTP2-Settings", name)))
+    return;
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL)
+    return; /* Upgrading is only for cleartext connections. */
+#endif
+  if (eq_ignore_case("Upgrade", name)) {
+    for (token = strtok(value, ", "); token != NULL;
+         token = strtok(NULL, ", ")) {
+      if (strcmp("h2c", token) == 0)
+        ctx->h2_upgrade |= H2_UPGRADE_TOKEN;
+    }
+    return;
+  }
+  len = decode_base64url(trim_whitespace(value), ctx->h2_settings,
+                         H2_UPGRADE_SETTINGS_MAX);
+  if (len != -1 && len % 6 == 0) {
+    ctx->h2_settings_len = (size_t)len;
+    ctx->h2_upgrade |= H2_UPGRADE_SETTINGS;
+  }
+}
+
+static void respond_h2_stream(struct connection_ctx *ctx) {
+  ctx->stage = 4;
+  ctx->deadline = NOW + CONFIG.write_timeout;
+  queue_response(ctx);
+}
+
+/* Upgrades the connection to HTTP/2 once the request has been read. The
+ * request moves to stream 1, and is responded to after the 101. Returns -1,
+ * to respond over HTTP/1.1 instead, if the settings are invalid or there's
+ * no memory for the upgrade. */
+static int upgrade_h2(struct connection_ctx *ctx) {
+  struct h2_connection *h2;
+  struct h2_stream *stream;
+
+  if (create_h2(ctx) == -1)
+    return -1;
+  h2 = ctx->h2;
+  if (apply_h2_settings(h2, ctx->h2_settings, ctx->h2_settings_len) !=
+      H2_NO_ERROR) {
+    free_h2(h2);
+    ctx->h2 = NULL;
+    return -1;
+  }
+  stream = &h2->streams[0];
+  stream->ctx = *ctx;
+  stream->ctx.h2 = NULL;
+  stream->ctx.stream_id = 1;
+  stream->id = 1;
+  stream->window = h2->initial_window;
+  stream->remote_closed = 1;
+  h2->streams_len = 1;
+  h2->last_stream_id = 1;
+  /* The stream has the request's buffers now. */
+  ctx->buffer = NULL;
+  ctx->buffer_len = 0;
+  ctx->read_len = 0;
+  ctx->query = NULL;
+  ctx->body = NULL;
+  if (CONFIG.verbose >= 2)
+    printf("(upgraded to HTTP/2) ");
+  queue_output(ctx, h2_switching_protocols, 0,
+               sizeof h2_switching_protocols - 1, OUTPUT_BORROWED);
+  start_h2(ctx, sizeof h2_preface - 1);
+  process_request(&stream->ctx);
+  respond_h2_stream(&stream->ctx);
+  return 0;
+}
+
+static struct h2_stream *find_h2_stream(struct h2_connection *h2,
+                                        unsigned long id) {
+  int i;
+
+  for (i = 0; id != 0 && i < H2_STREAMS_MAX; i++) {
+    if (h2->streams[i].id == id)
+      return &h2->streams[i];
+  }
+  return NULL;
+}
+
+/* Takes a free slot for a new stream, or returns NULL if there's none. */
+static struct h2_stream *open_h2_stream(struct connection_ctx *ctx,
+                                        unsigned long id) {
+  struct h2_connection *h2 = ctx->h2;
+  struct h2_stream *stream;
+  int i;
+
+  for (i = 0; i < H2_STREAMS_MAX && h2->streams[i].id != 0; i++)
+    ;
+  if (i == H2_STREAMS_MAX)
+    return NULL;
+  stream = &h2->streams[i];
+  memset(stream, 0, sizeof *stream);
+  stream->id = id;
+  stream->window = h2->initial_window;
+  stream->ctx.ip = ctx->ip;
+  stream->ctx.stream_id = id;
+  stream->ctx.deadline = h2->header_deadline;
+  h2->streams_len++;
+  return stream;
+}
+
+/* Takes in a header of a new stream's request, like stage 1 of
+ * handle_connection. The strings can be in the dynamic table, so they are
+ * copied before being changed or kept. */
+static void read_h2_request_header(struct h2_stream *stream, char *name,
+                                   char *value) {
+  struct connection_ctx *ctx;
+  long content_length;
+  char *cookie;
+  int i;
+
+  if (stream == NULL)
+    return;
+  ctx = &stream->ctx;
+  if (strcmp(":method", name) == 0) {
+    for (i = 0; i < 3 && strcmp(method_names[i], value) != 0; i++)
+      ;
+    if (i == 3 || stream->has_method)
+      stream->malformed = 1;
+    else
+      ctx->method = (enum http_method)i;
+    stream->has_method = 1;
+  } else if (strcmp(":path", name) == 0) {
+    if (ctx->buffer != NULL || (ctx->buffer = copy_string(value)) == NULL)
+      stream->malformed = 1;
+  } else if (strcmp("content-length", name) == 0) {
+    content_length = parse_content_length(value);
+    if (content_length == -1)
+      stream->malformed = 1;
+    else
+      ctx->expected_content_length = content_length;
+  } else if (strcmp("cookie", name) == 0) {
+    /* Each cookie can have a header of its own. */
+    cookie = copy_string(value);
+    if (cookie != NULL)
+      parse_cookie(ctx, cookie);
+    free(cookie);
+  }
+}
+
+/* Decodes the header block into the request of the stream, or only into the
+ * dynamic table if stream is NULL. Returns -1 if the block is invalid. */
+static int decode_h2_headers(struct h2_connection *h2,
+                             struct h2_stream *stream) {
+  struct hpack_table *table = &h2->decoder;
+  unsigned char *bytes = h2->header_block;
+  unsigned char *end = &h2->header_block[h2->header_block_len];
+  unsigned long index;
+  char *name, *value;
+  int indexing;
+
+  while (bytes < end) {
+    if ((*bytes & 0xE0) == 0x20) {
+      /* A dynamic table size update. */
+      if (hpack_get_integer(&bytes, end, 5, &index) == -1 ||
+          index > HPACK_TABLE_SIZE)
+        return -1;
+      table->max_size = index;
+      evict_hpack_entries(table, 0);
+      continue;
+    }
+    if (*bytes & 0x80) {
+      /* A header from the tables. */
+      if (hpack_get_integer(&bytes, end, 7, &index) == -1 ||
+          hpack_lookup(table, index, &name, &value) == -1)
+        return -1;
+      read_h2_request_header(stream, name, value);
+      continue;
+    }
+    /* A literal, added to the dynamic table (01), or not (0000 or 0001). The
+     * name is either a string or from the tables. */
+    indexing = (*bytes & 0xC0) == 0x40;
+    if (hpack_get_integer(&bytes, end, indexing ? 6 : 4, &index) == -1)
+      return -1;
+    if (index == 0)
+      name = hpack_get_string(&bytes, end);
+    else if (hpack_lookup(table, index, &name, &value) == 0)
+      name = copy_string(name);
+    else
+      return -1;
+    value = hpack_get_string(&bytes, end);
+    if (name == NULL || value == NULL) {
+      free(name);
+      free(value);
+      return -1;
+    }
+    read_h2_request_header(stream, name, value);
+    if (indexing) {
+      add_hpack_entry(table, name, value);
+    } else {
+      free(name);
+      free(value);
+    }
+  }
+  return 0;
+}
+
+/* Processes the request once the client has sent all of it, and the state
+ * is this server's, see take_over. handle_h2 calls this again for the ones
+ * which waited for it. */
+static void end_h2_request(struct h2_stream *stream) {
+  struct connection_ctx *ctx = &stream->ctx;
+
+  stream->remote_closed = 1;
+  if (ctx->stage != 2)
+    return; /* Responded to already. */
+  if (TAKEOVER_FD != -1) {
+    ctx->deadline = TAKEOVER_DEADLINE;
+    return;
+  }
+  if (ctx->body != NULL)
+    finish_form_field(ctx, form_keys[ctx->route->resource], ctx->body_len);
+  process_request(ctx);
+  respond_h2_stream(ctx);
+}
+
+/* Routes a new stream's request, like stages 0 and 1 of handle_connection,
+ * and processes it right away if it has no body. */
+static void start_h2_request(struct h2_stream *stream, int end_stream) {
+  struct connection_ctx *ctx = &stream->ctx;
+
+  stream->remote_closed = end_stream;
+  if (stream->malformed || !stream->has_method || ctx->buffer == NULL) {
+    ctx->response = RESPONSE_400;
+    goto respond;
+  }
+  if (CONFIG.verbose >= 2)
+    printf("%s ", method_names[ctx->method]);
+  if (route_request(ctx, ctx->buffer) == -1)
+    goto respond;
+  /* Reject oversized bodies before reading (or allocating) anything. */
+  if (ctx->method == POST &&
+      ctx->expected_content_length > max_body_lengths[ctx->route->resource]) {
+    ctx->response = RESPONSE_413;
+    goto respond;
+  }
+  ctx->stage = 2;
+  ctx->deadline = NOW + CONFIG.body_timeout;
+  if (end_stream)
+    end_h2_request(stream);
+  return;
+
+respond:
+  respond_h2_stream(ctx);
+}
+
+/* Adds DATA to the request's body, parsing the form as it arrives, like
+ * stage 2 of handle_connection. The bodies of other requests are ignored. */
+static void read_h2_body(struct h2_stream *stream, unsigned char *data,
+                         size_t len) {
+  struct connection_ctx *ctx = &stream->ctx;
+  char *key;
+
+  if (ctx->stage != 2 || ctx->method != POST)
+    return;
+  key = form_keys[ctx->route->resource];
+  if (key == NULL)
+    return;
+  if (ctx->body_len + len > max_body_lengths[ctx->route->resource]) {
+    ctx->response = RESPONSE_413;
+    respond_h2_stream(ctx);
+    return;
+  }
+  if (ctx->body == NULL) {
+    ctx->body = acquire_body_buffer();
+    if (ctx->body == NULL) {
+      perror("error when allocating buffer for request body");
+      ctx->response = RESPONSE_503;
+      respond_h2_stream(ctx);
+      return;
+    }
+  }
+  memcpy(&ctx->body[ctx->body_len], data, len);
+  parse_form(ctx, key, ctx->body_len + len);
+  ctx->body_len += len;
+}
+
+/* Handles a whole header block: a new stream's request, or the trailers
+ * which end an open one's. */
+static void end_h2_headers(struct connection_ctx *ctx) {
+  struct h2_connection *h2 = ctx->h2;
+  unsigned long id = h2->header_stream;
+  struct h2_stream *stream = find_h2_stream(h2, id);
+  int is_new = stream == NULL && id > h2->last_stream_id;
+
+  h2->header_stream = 0;
+  if (is_new) {
+    h2->last_stream_id = id;
+    stream = h2->goaway ? NULL : open_h2_stream(ctx, id);
+    if (stream == NULL)
+      put_h2_u32_frame(h2, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+  }
+  /* The blocks of refused or closed streams are decoded too, to keep the
+   * dynamic table in step with the client's. */
+  if (decode_h2_headers(h2, is_new ? stream : NULL) == -1)
+    close_h2(h2, H2_COMPRESSION_ERROR);
+  else if (is_new && stream != NULL)
+    start_h2_request(stream, h2->header_end_stream);
+  else if (stream != NULL && !stream->remote_closed && !h2->header_end_stream)
+    close_h2(h2, H2_PROTOCOL_ERROR);
+  else if (stream != NULL && !stream->remote_closed)
+    end_h2_request(stream);
+}
+
+/* Adds a HEADERS or CONTINUATION frame's fragment of a header block. Returns
+ * the error to close the connection with, if the block gets longer than
+ * H2_HEADER_BLOCK_MAX or there's no memory for it, or H2_NO_ERROR. */
+static enum h2_error append_h2_header_block(struct h2_connection *h2,
+                                            unsigned char *fragment,
+                                            size_t len) {
+  unsigned char *block;
+
+  if (h2->header_block_len + len > H2_HEADER_BLOCK_MAX)
+    return H2_ENHANCE_YOUR_CALM;
+  if (h2->header_block_len + len > h2->header_block_cap) {
+    block = realloc(h2->header_block, h2->header_block_len + len);
+    if (block == NULL) {
+      perror("error when stretching a header block buffer");
+      return H2_INTERNAL_ERROR;
+    }
+    h2->header_block = block;
+    h2->header_block_cap = h2->header_block_len + len;
+  }
+  memcpy(&h2->header_block[h2->header_block_len], fragment, len);
+  h2->header_block_len += len;
+  return H2_NO_ERROR;
+}
+
+/* Strips the padding off a DATA or HEADERS frame's payload. Returns -1 if the
+ * padding is longer than the payload. */
+static int strip_h2_padding(int flags, unsigned char **payload, size_t *len) {
+  if ((flags & H2_PADDED) == 0)
+    return 0;
+  if (*len == 0 || (*payload)[0] >= *len)
+    return -1;
+  *len -= 1 + (*payload)[0];
+  (*payload)++;
+  return 0;
+}
+
+/* Handles the frame in h2->in. Errors of the whole connection close it with a
+ * GOAWAY, and the frames of closed streams are ignored. Sends at most
+ * H2_CONTROL_MAX bytes in reply. */
+static void handle_h2_frame(struct connection_ctx *ctx) {
+  struct h2_connection *h2 = ctx->h2;
+  unsigned char *payload = &h2->in[H2_FRAME_HEADER_LEN];
+  size_t len = h2->in_len - H2_FRAME_HEADER_LEN, frame_len = len;
+  int type = h2->in[3], flags = h2->in[4];
+  unsigned long id = get_u32(&h2->in[5]) & 0x7FFFFFFFUL, increment;
+  struct h2_stream *stream = find_h2_stream(h2, id);
+  enum h2_error error;
+
+  /* The preface ends with the client's SETTINGS, and the frames of a header
+   * block can't be interleaved with others. */
+  if ((!h2->settings_received && type != H2_SETTINGS) ||
+      (h2->header_stream != 0 &&
+       (type != H2_CONTINUATION || id != h2->header_stream))) {
+    close_h2(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+  switch (type) {
+  case H2_DATA:
+    if (id == 0 || id > h2->last_stream_id ||
+        strip_h2_padding(flags, &payload, &len) == -1) {
+      close_h2(h2, H2_PROTOCOL_ERROR);
+      break;
+    }
+    /* The windows are opened back up right away, as the body is copied out
+     * of the frame. */
+    if (frame_len > 0)
+      put_h2_u32_frame(h2, H2_WINDOW_UPDATE, 0, frame_len);
+    if (stream == NULL || stream->remote_closed)
+      break;
+    read_h2_body(stream, payload, len);
+    if (flags & H2_END_STREAM)
+      end_h2_request(stream);
+    else if (frame_len > 0)
+      put_h2_u32_frame(h2, H2_WINDOW_UPDATE, id, frame_len);
+    break;
+  case H2_HEADERS:
+    if (id == 0 || id % 2 == 0 ||
+        strip_h2_padding(flags, &payload, &len) == -1 ||
+        ((flags & H2_PRIORITY_FLAG) && len < 5)) {
+      close_h2(h2, H2_PROTOCOL_ERROR);
+      break;
+    }
+    if (flags & H2_PRIORITY_FLAG) {
+      payload += 5;
+      len -= 5;
+    }
+    h2->header_stream = id;
+    h2->header_end_stream = flags & H2_END_STREAM;
+    h2->header_deadline = NOW + CONFIG.header_timeout;
+    h2->header_block_len = 0;
+    /* The rest is like a CONTINUATION. */
+  case H2_CONTINUATION:
+    if (h2->header_stream == 0)
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    else if ((error = append_h2_header_block(h2, payload, len)) !=
+             H2_NO_ERROR)
+      close_h2(h2, error);
+    else if (flags & H2_END_HEADERS)
+      end_h2_headers(ctx);
+    break;
+  case H2_RST_STREAM:
+    if (id == 0 || id > h2->last_stream_id || len != 4)
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    else if (stream != NULL)
+      release_h2_stream(h2, stream);
+    break;
+  case H2_SETTINGS:
+    if (id != 0 || len % 6 != 0 || ((flags & H2_ACK) && len != 0)) {
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    } else if ((flags & H2_ACK) == 0) {
+      error = apply_h2_settings(h2, payload, len);
+      if (error != H2_NO_ERROR) {
+        close_h2(h2, error);
+      } else {
+        put_h2_frame(h2, 0, H2_SETTINGS, H2_ACK, 0);
+        h2->settings_received = 1;
+      }
+    }
+    break;
+  case H2_PUSH_PROMISE:
+    close_h2(h2, H2_PROTOCOL_ERROR); /* Only servers push. */
+    break;
+  case H2_PING:
+    if (id != 0 || len != 8)
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    else if ((flags & H2_ACK) == 0)
+      memcpy(put_h2_frame(h2, 8, H2_PING, H2_ACK, 0), payload, 8);
+    break;
+  case H2_GOAWAY:
+    /* The client is leaving, once the streams it has opened are done. */
+    if (id != 0 || len < 8)
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    else
+      h2->goaway = 1;
+    break;
+  case H2_WINDOW_UPDATE:
+    increment = len == 4 ? get_u32(payload) & 0x7FFFFFFFUL : 0;
+    if (len != 4 || id > h2->last_stream_id || (id == 0 && increment == 0)) {
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    } else if (id == 0) {
+      if (h2->window > 0 && (long)increment > H2_WINDOW_MAX - h2->window)
+        close_h2(h2, H2_FLOW_CONTROL_ERROR);
+      else
+        h2->window += (long)increment;
+    } else if (stream != NULL) {
+      if (increment == 0 || (stream->window > 0 && (long)increment >
+                                                       H2_WINDOW_MAX -
+                                                           stream->window)) {
+        put_h2_u32_frame(h2, H2_RST_STREAM, id,
+                         increment == 0 ? H2_PROTOCOL_ERROR
+                                        : H2_FLOW_CONTROL_ERROR);
+        release_h2_stream(h2, stream);
+      } else {
+        stream->window += (long)increment;
+      }
+    }
+    break;
+  default:
+    break; /* PRIORITY, which is only advice, and unknown frames. */
+  }
+}
+
+/* Reads the rest of the client's preface, or some of the next frame, and
+ * handles the frame once it's all in. Returns like connection_recv. */
+static ssize_t read_h2(struct connection_ctx *ctx) {
+  struct h2_connection *h2 = ctx->h2;
+  size_t frame_len, want = H2_FRAME_HEADER_LEN;
+  ssize_t result;
+
+  if (h2->preface_left > 0) {
+    result = connection_recv(ctx, (char *)h2->in, h2->preface_left);
+    if (result <= 0)
+      return result;
+    if (memcmp(h2->in, &h2_preface[sizeof h2_preface - 1 - h2->preface_left],
+               result) != 0)
+      close_h2(h2, H2_PROTOCOL_ERROR);
+    h2->preface_left -= result;
+    return result;
+  }
+  /* The frame header first, then the payload it gives the length of. */
+  if (h2->in_len >= H2_FRAME_HEADER_LEN)
+    want += get_u32(h2->in) >> 8;
+  result = connection_recv(ctx, (char *)&h2->in[h2->in_len],
+                           want - h2->in_len);
+  if (result <= 0)
+    return result;
+  h2->in_len += result;
+  if (h2->in_len < H2_FRAME_HEADER_LEN)
+    return result;
+  frame_len = get_u32(h2->in) >> 8;
+  if (frame_len > H2_FRAME_MAX) {
+    close_h2(h2, H2_FRAME_SIZE_ERROR);
+  } else if (h2->in_len == H2_FRAME_HEADER_LEN + frame_len) {
+    handle_h2_frame(ctx);
+    h2->in_len = 0;
+  }
+  return result;
+}
+
+/* Closes the stream once its response has been sent. A client which is still
+ * sending the request is told to stop. */
+static void finish_h2_stream(struct h2_connection *h2,
+                             struct h2_stream *stream) {
+  if (CONFIG.verbose >= 2)
+    printf("<- responded with %s on HTTP/2 stream %lu\n",
+           static_responses[stream->ctx.response].status, stream->id);
+  if (!stream->remote_closed)
+    put_h2_u32_frame(h2, H2_RST_STREAM, stream->id, H2_NO_ERROR);
+  release_h2_stream(h2, stream);
+}
+
+/* Writes the next frame of the stream's response: its header block in a
+ * HEADERS frame, then the body in DATA frames, as the flow control windows
+ * allow. Leaves room for the replies to the client's frames. Returns 1 if a
+ * frame was written, 0 if the stream has to wait. */
+static int write_h2_stream(struct h2_connection *h2, struct h2_stream *stream) {
+  struct connection_ctx *ctx = &stream->ctx;
+  struct output_segment *segment;
+  unsigned char *payload;
+  size_t room, len, body_len;
+  long window = h2->window < stream->window ? h2->window : stream->window;
+  int i;
+
+  if (stream->id == 0 || ctx->stage != 4 ||
+      h2->out_len + 2 * H2_CONTROL_MAX + H2_FRAME_HEADER_LEN >= H2_OUT_LEN)
+    return 0;
+  room = H2_OUT_LEN - 2 * H2_CONTROL_MAX - H2_FRAME_HEADER_LEN - h2->out_len;
+  payload = &h2->out[h2->out_len + H2_FRAME_HEADER_LEN];
+  if (ctx->output_first == 0) {
+    /* The header block, from queue_head. */
+    len = ctx->output[0].end;
+    if (len > room)
+      return 0;
+    for (body_len = 0, i = 1; i < ctx->output_len; i++)
+      body_len += ctx->output[i].end - ctx->output[i].start;
+    memcpy(payload, ctx->output[0].data, len);
+    put_h2_frame(h2, len, H2_HEADERS,
+                 H2_END_HEADERS | (body_len == 0 ? H2_END_STREAM : 0),
+                 stream->id);
+  } else {
+    segment = &ctx->output[ctx->output_first];
+    len = segment->end - segment->start;
+    if (len > H2_FRAME_MAX)
+      len = H2_FRAME_MAX;
+    if (len > room)
+      len = room;
+    if (window <= 0 || len == 0)
+      return 0;
+    if ((long)len > window)
+      len = (size_t)window;
+    if (segment->owner != OUTPUT_FILE) {
+      memcpy(payload, &segment->data[segment->start], len);
+    } else if (read_file(segment->file, segment->start, (char *)payload,
+                         len) != len) {
+      perror("error when reading a response");
+      put_h2_u32_frame(h2, H2_RST_STREAM, stream->id, H2_INTERNAL_ERROR);
+      release_h2_stream(h2, stream);
+      return 1;
+    }
+    h2->window -= (long)len;
+    stream->window -= (long)len;
+    /* Whether this is the end depends on the segments after this one. */
+    consume_output(ctx, len);
+    put_h2_frame(h2, len, H2_DATA,
+                 ctx->output_first == ctx->output_len ? H2_END_STREAM : 0,
+                 stream->id);
+    if (ctx->output_first == ctx->output_len)
+      finish_h2_stream(h2, stream);
+    return 1;
+  }
+  consume_output(ctx, len);
+  if (ctx->output_first == ctx->output_len)
+    finish_h2_stream(h2, stream);
+  return 1;
+}
+
+/* The earliest deadline of the streams, of the header block being read, or
+ * of the connection being idle if there are no streams. Only the requests
+ * moving on move these, so PINGs or frames trickling in don't keep the
+ * connection open. */
+static time_t next_h2_deadline(struct h2_connection *h2) {
+  time_t deadline = h2->idle_deadline;
+  int i, has_deadline = h2->streams_len == 0;
+
+  for (i = 0; i < H2_STREAMS_MAX; i++) {
+    if (h2->streams[i].id != 0 &&
+        (!has_deadline || h2->streams[i].ctx.deadline < deadline)) {
+      deadline = h2->streams[i].ctx.deadline;
+      has_deadline = 1;
+    }
+  }
+  if (h2->header_stream != 0 && h2->header_deadline < deadline)
+    deadline = h2->header_deadline;
+  return deadline;
+}
+
+/* Serves an HTTP/2 connection: reads and handles the client's frames, and
+ * sends the responses of the streams as the flow control windows allow, one
+ * frame of each stream at a time. Returns 0 when the connection is done, -1
+ * otherwise, like handle_connection. */
+static int handle_h2(struct connection_ctx *ctx) {
+  struct h2_connection *h2 = ctx->h2;
+  ssize_t result;
+  int progress, i;
+
+  for (i = 0; TAKEOVER_FD == -1 && i < H2_STREAMS_MAX; i++) {
+    if (h2->streams[i].id != 0 && h2->streams[i].remote_closed)
+      end_h2_request(&h2->streams[i]);
+  }
+  do {
+    progress = 0;
+    /* The 101 of an upgrade goes before the frames. */
+    if (ctx->output_first < ctx->output_len && flush_output(ctx) == -1)
+      return -1;
+    if (h2->out_start < h2->out_len) {
+      result = connection_send(ctx, (char *)&h2->out[h2->out_start],
+                               h2->out_len - h2->out_start);
+      if (result == -1 && !would_block())
+        return -1;
+      if (result > 0) {
+        h2->out_start += result;
+        progress = 1;
+      }
+      if (h2->out_start == h2->out_len)
+        h2->out_start = h2->out_len = 0;
+    }
+    if (h2->out_len == 0 &&
+        (h2->closing || (h2->goaway && h2->streams_len == 0)))
+      return 0;
+
+    /* A restarted server is waiting for the connections to finish. */
+    if (HANDOFF_FD != -1 && !h2->goaway &&
+        h2->out_len + H2_CONTROL_MAX <= H2_OUT_LEN)
+      put_h2_goaway(h2, H2_NO_ERROR);
+
+    while (!h2->closing && !h2->eof &&
+           h2->out_len + H2_CONTROL_MAX <= H2_OUT_LEN) {
+      result = read_h2(ctx);
+      if (result == -1 && !would_block())
+        return -1;
+      if (result == -1)
+        break;
+      progress = 1;
+      if (result == 0) {
+        /* The client has stopped sending, so only the requests it has
+         * finished are responded to. */
+        h2->eof = h2->goaway = 1;
+        for (i = 0; i < H2_STREAMS_MAX; i++) {
+          if (h2->streams[i].id != 0 && h2->streams[i].ctx.stage != 4)
+            release_h2_stream(h2, &h2->streams[i]);
+        }
+      }
+    }
+
+    if (h2->out_start > 0) {
+      memmove(h2->out, &h2->out[h2->out_start], h2->out_len - h2->out_start);
+      h2->out_len -= h2->out_start;
+      h2->out_start = 0;
+    }
+    for (i = 0; !h2->closing && i < H2_STREAMS_MAX; i++) {
+      if (write_h2_stream(h2, &h2->streams[(h2->next_stream + i) %
+                                           H2_STREAMS_MAX]))
+        progress = 1;
+    }
+    h2->next_stream = (h2->next_stream + 1) % H2_STREAMS_MAX;
+  } while (progress);
+  ctx->deadline = next_h2_deadline(h2);
+
+#ifdef _WIN32
+  WSASetLastError(WSAEWOULDBLOCK);
+#else
+  errno = EAGAIN;
+#endif
+  return -1;
+}
+
+/* Returns 0 when the connection is closed, -1 otherwise.
+ * This should keep being called if the return value is -1. */
+static int handle_connection(struct connection_ctx *ctx) {
+  ssize_t result;
+  long content_length;
+  char *token, *key;
+  int i;
+
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL && !ctx->handshake_done) {
+    result = tls_result(ctx, SSL_accept(ctx->ssl));
+    if (result == -1)
+      return -1;
+    else if (result == 0)
+      goto cleanup;
+    ctx->handshake_done = 1;
+    if (CONFIG.verbose >= 2)
+      printf("(TLS, kernel offload %s) ",
+             BIO_get_ktls_send(SSL_get_wbio(ctx->ssl)) ? "on" : "off");
+  }
+#endif
+
+  switch (ctx->stage) {
+  case 5:
+  h2:
+    /* HTTP/2, after the client's preface or an upgrade. */
+    if (handle_h2(ctx) == -1)
+      return -1;
+    goto cleanup;
+
+  case 0:
+    /* Read the status line. */
+    result = read_line(ctx, &ctx->buffer, &ctx->buffer_len,
+                       &ctx->read_len);
+    if (result == -1) {
+      return -1;
+    } else if (result == -2) {
+      ctx->response = RESPONSE_400;
+      goto respond;
+    } else if (result == -3) {
+      goto cleanup; /* The client left mid-request. */
+    }
+    /* HTTP/2 with prior knowledge: the rest of the preface follows. */
+    if (CONFIG.http2 && strcmp(h2_preface_line, ctx->buffer) == 0) {
+      if (create_h2(ctx) == -1)
+        goto cleanup;
+      start_h2(ctx, sizeof h2_preface - sizeof h2_preface_line);
+      goto h2;
+    }
+    token = strtok(ctx->buffer, " ");
+    for (i = 0; token != NULL && i < 3; i++) {
+      if (strcmp(method_names[i], token) == 0)
+        break;
+    }
+    if (token == NULL || i == 3) {
+      ctx->response = RESPONSE_400;
+      goto respond;
+    }
+    ctx->method = (enum http_method)i;
+    if (CONFIG.verbose >= 2)
+      printf("%s ", token);
+    if (route_request(ctx, strtok(NULL, " ")) == -1)
+      goto respond;
+
+    /* Reset the line length after processing the statusline. */
+    ctx->read_len = 0;
+    ctx->stage++;
+
+  case 1:
+    /* Read the headers. */
+    for (;;) {
+      result = read_line(ctx, &ctx->buffer, &ctx->buffer_len,
+                         &ctx->read_len);
+      if (result == -1) {
+        return -1;
+      } else if (result == -2) {
+        ctx->response = RESPONSE_400;
+        goto respond;
+      } else if (result == -3) {
+        goto cleanup; /* The client left mid-request. */
+      }
 
       token = strtok(ctx->buffer, ":");
       if (token != NULL && eq_ignore_case("Content-Length", token)) {
-        token = strtok(NULL, ":");
-        ctx->expected_content_length = atoi(token);
-        if (RISKYCHAT_VERBOSE >= 2)
+        content_length = parse_content_length(strtok(NULL, ":"));
+        if (content_length == -1) {
+          ctx->response = RESPONSE_400;
+          goto respond;
+        }
+        ctx->expected_content_length = content_length;
+        if (CONFIG.verbose >= 2)
           printf("(%ld) ", ctx->expected_content_length);
       } else if (token != NULL && eq_ignore_case("Cookie", token)) {
-        token = strtok(NULL, ":");
-        key = strtok(token, "=");
-        while (key != NULL) {
-          value = strtok(NULL, ";");
-          if (eq_ignore_whitespace("riskyid", key)) {
-            ctx->user_id = atoi(value);
-            break;
-          }
-          key = strtok(NULL, "=");
-        }
+        parse_cookie(ctx, strtok(NULL, ":"));
+      } else if (token != NULL && CONFIG.http2) {
+        read_upgrade_header(ctx, token, strtok(NULL, "\r\n"));
       }
 
       /* The end of the header section is marked by an empty line. */
@@ -901,148 +5711,75 @@ static int handle_connection(struct connection_ctx *ctx) {
       /* Reset the line length after processing the line. */
       ctx->read_len = 0;
     }
+
+    /* Reject oversized bodies before reading (or allocating) anything. */
+    if (ctx->method == POST &&
+        ctx->expected_content_length >
+            max_body_lengths[ctx->route->resource]) {
+      ctx->response = RESPONSE_413;
+      goto respond;
+    }
     ctx->stage++;
+    ctx->deadline = NOW + CONFIG.body_timeout;
 
   case 2:
-    /* Read the body, when needed. */
-    if (ctx->method == POST && ctx->expected_content_length > 0) {
-      if (RISKYCHAT_VERBOSE >= 2)
+    /* Read the body, when needed, parsing the form as the bytes arrive. */
+    key = form_keys[ctx->route->resource];
+    if (ctx->method == POST && key != NULL &&
+        ctx->expected_content_length > 0) {
+      if (CONFIG.verbose >= 2)
         printf("br");
-      if (ctx->buffer_len < ctx->expected_content_length + 1) {
-        ctx->buffer_len = ctx->expected_content_length + 1;
-        ctx->buffer = realloc(ctx->buffer, ctx->buffer_len);
-        if (ctx->buffer == NULL) {
-          perror("error when allocating buffer for user response");
-          exit(EXIT_FAILURE);
+      if (ctx->body == NULL) {
+        ctx->body = acquire_body_buffer();
+        if (ctx->body == NULL) {
+          perror("error when allocating buffer for request body");
+          ctx->response = RESPONSE_503;
+          goto respond;
         }
       }
-      while (ctx->read_len < ctx->expected_content_length) {
-        result = recv(ctx->connect_fd, &ctx->buffer[ctx->read_len],
-                      ctx->expected_content_length, 0);
+      while (ctx->body_len < ctx->expected_content_length) {
+        result = connection_recv(ctx, &ctx->body[ctx->body_len],
+                                 ctx->expected_content_length - ctx->body_len);
         if (result == -1)
           return -1;
-        else
-          ctx->read_len += result;
+        else if (result == 0)
+          goto cleanup; /* The client left before sending the whole body. */
+        parse_form(ctx, key, ctx->body_len + result);
+        ctx->body_len += result;
       }
-      ctx->buffer[ctx->expected_content_length] = '\0';
-      if (RISKYCHAT_VERBOSE >= 2)
-        printf("\b\b(%ld bytes read) ", ctx->expected_content_length);
+      finish_form_field(ctx, key, ctx->body_len);
+      if (CONFIG.verbose >= 2)
+        printf("\b\b(%ld bytes read) ", ctx->body_len);
     }
     ctx->stage++;
 
   case 3:
-    /* Respond. */
-    switch (ctx->requested_resource) {
-    case RESOURCE_INDEX:
-      if (ctx->method == GET || ctx->method == HEAD) {
-        if (ctx->user_id == 0 || is_expired_user(ctx->user_id))
-          goto respond_login;
-        else
-          goto respond_chat;
-      } else
-        break;
-    case RESOURCE_NEW_POST:
-      if (ctx->method == POST) {
-        add_new_post(ctx->buffer, ctx->expected_content_length, ctx->user_id);
-        refresh_user(ctx->user_id);
-        goto respond_redirect_to_chat;
-      } else
-        break;
-    case RESOURCE_LOGIN:
-      if (ctx->method == POST) {
-        if (ctx->user_id == 0 || is_expired_user(ctx->user_id)) {
-          decode_percent(ctx->buffer, &ctx->read_len);
-          name_len = strlen(ctx->buffer) - 5;
-          if (name_len < 0) {
-            name_len = 0;
-          } else if (name_len > 30) {
-            name_len = 30;
-          }
-          name = malloc(name_len + 1);
-          if (name == NULL) {
-            perror("error when allocating name");
-            exit(EXIT_FAILURE);
-          }
-          memcpy(name, &ctx->buffer[5], name_len);
-          name[name_len] = '\0';
-          if (is_name_reserved(name)) {
-            goto respond_login;
-          } else {
-            ctx->user_id = add_user(name);
-          }
-        }
-        goto respond_add_user;
-      } else
-        break;
-    default:
-      goto respond_404;
-    }
-    goto respond_400;
-  }
-
-respond_login:
-  result = write_http_response(ctx->connect_fd, &ctx->written_len, "200 OK",
-                               sizeof "200 OK" - 1, static_response_login,
-                               sizeof static_response_login - 1,
-                               ctx->method == HEAD, "");
-  if (result == -1)
-    return -1;
-  if (RISKYCHAT_VERBOSE >= 2)
-    printf("<- responded with login\n");
-  goto cleanup;
-
-respond_redirect_to_chat:
-  result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                               "303 See Other", sizeof "303 See Other" - 1, "",
-                               0, ctx->method == HEAD, "Location: /\r\n");
-  if (result == -1)
-    return -1;
-  if (RISKYCHAT_VERBOSE >= 2)
-    printf("<- responded with login\n");
-  goto cleanup;
-
-respond_add_user:
-  snprintf(buf, sizeof buf, "Location: /\r\nSet-Cookie: riskyid=%d\r\n",
-           ctx->user_id);
-  result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                               "303 See Other", sizeof "303 See Other" - 1, "",
-                               0, ctx->method == HEAD, buf);
-  if (result == -1)
-    return -1;
-  if (RISKYCHAT_VERBOSE >= 2)
-    printf("<- responded with login\n");
-  goto cleanup;
-
-respond_chat:
-  result = write_http_chat_response(ctx->connect_fd, &ctx->written_len,
-                                    ctx->method == HEAD);
-  if (result == -1)
-    return -1;
-  if (RISKYCHAT_VERBOSE >= 2)
-    printf("<- responded with chat\n");
-  goto cleanup;
-
-respond_400:
-  result = write_http_response(
-      ctx->connect_fd, &ctx->written_len, "400 Bad Request",
-      sizeof "400 Bad Request" - 1, static_response_400,
-      sizeof static_response_400 - 1, ctx->method == HEAD, "");
-  if (result == -1)
-    return -1;
-  if (RISKYCHAT_VERBOSE >= 2)
-    printf("<- responded with 400\n");
-  goto cleanup;
-
-respond_404:
-  result = write_http_response(
-      ctx->connect_fd, &ctx->written_len, "404 Not Found",
-      sizeof "404 Not Found" - 1, static_response_404,
-      sizeof static_response_404 - 1, ctx->method == HEAD, "");
-  if (result == -1)
-    return -1;
-  if (RISKYCHAT_VERBOSE >= 2)
-    printf("<- responded with 404\n");
-  goto cleanup;
+#ifndef _WIN32
+    if (TAKEOVER_FD != -1) {
+      /* Waiting for the running server's state, see take_over. */
+      ctx->deadline = TAKEOVER_DEADLINE;
+      errno = EAGAIN;
+      return -1;
+    }
+#endif
+    if (ctx->h2_upgrade == (H2_UPGRADE_TOKEN | H2_UPGRADE_SETTINGS) &&
+        upgrade_h2(ctx) == 0)
+      goto h2;
+    /* Process the request and pick the response. */
+    process_request(ctx);
+
+  respond:
+    ctx->stage = 4;
+    ctx->deadline = NOW + CONFIG.write_timeout;
+    queue_response(ctx);
+
+  case 4:
+    /* Respond. This stage is repeated until the whole response is sent. */
+    if (flush_output(ctx) == -1)
+      return -1;
+    if (CONFIG.verbose >= 2)
+      printf("<- responded with %s\n", static_responses[ctx->response].status);
+  }
 
 cleanup:
   cleanup_connection(ctx);
@@ -1050,21 +5787,326 @@ cleanup:
 }
 
 static void cleanup_connection(struct connection_ctx *ctx) {
-  free(ctx->buffer);
+  free_request(ctx);
+  if (ctx->h2 != NULL)
+    free_h2(ctx->h2);
+#ifdef RISKYCHAT_TLS
+  if (ctx->ssl != NULL) {
+    if (ctx->handshake_done)
+      SSL_shutdown(ctx->ssl);
+    SSL_free(ctx->ssl);
+  }
+#endif
   shutdown(ctx->connect_fd, SHUT_RDWR);
   close(ctx->connect_fd);
 }
 
 static void remove_connection(struct connection_ctx **connections,
                               int *connections_len, int i) {
+  remove_ip_connection((*connections)[i].ip);
+  cancel_timer(&CONNECTION_TIMERS, i);
   if (i == *connections_len - 1) {
     (*connections_len)--;
   } else {
     (*connections)[i] = (*connections)[*connections_len - 1];
+    move_timer(&CONNECTION_TIMERS, *connections_len - 1, i);
     (*connections_len)--;
   }
 }
 
+static int init_timer_wheel(struct timer_wheel *wheel, int timers_len,
+                            time_t now) {
+  int i;
+
+  wheel->timers = malloc(timers_len * sizeof wheel->timers[0]);
+  if (wheel->timers == NULL)
+    return -1;
+  for (i = 0; i < timers_len; i++) {
+    wheel->timers[i].level = -1;
+    wheel->timers[i].deadline = 0;
+  }
+  for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    wheel->slots[0][i] = -1;
+    wheel->slots[1][i] = -1;
+  }
+  wheel->now = now;
+  return 0;
+}
+
+/* Schedules the timer to expire at the deadline, replacing its previous
+ * deadline. The first level has a slot per second for the next 64 seconds,
+ * the second level a slot per 64 seconds after that. Timers further out than
+ * that are put in the last second-level slot, and rescheduled when their slot
+ * is reached. */
+static void schedule_timer(struct timer_wheel *wheel, int id, time_t deadline) {
+  struct timer *timer;
+  time_t block, now_block;
+
+  cancel_timer(wheel, id);
+  timer = &wheel->timers[id];
+  timer->deadline = deadline;
+  if (deadline < wheel->now)
+    deadline = wheel->now;
+
+  if (deadline - wheel->now < TIMER_WHEEL_SLOTS) {
+    timer->level = 0;
+    timer->slot = deadline & TIMER_WHEEL_MASK;
+  } else {
+    block = deadline >> TIMER_WHEEL_BITS;
+    now_block = wheel->now >> TIMER_WHEEL_BITS;
+    if (block - now_block > TIMER_WHEEL_MASK)
+      block = now_block + TIMER_WHEEL_MASK;
+    timer->level = 1;
+    timer->slot = block & TIMER_WHEEL_MASK;
+  }
+
+  timer->prev = -1;
+  timer->next = wheel->slots[timer->level][timer->slot];
+  if (timer->next != -1)
+    wheel->timers[timer->next].prev = id;
+  wheel->slots[timer->level][timer->slot] = id;
+}
+
+static void cancel_timer(struct timer_wheel *wheel, int id) {
+  struct timer *timer = &wheel->timers[id];
+
+  if (timer->level == -1)
+    return;
+  if (timer->prev != -1)
+    wheel->timers[timer->prev].next = timer->next;
+  else
+    wheel->slots[timer->level][timer->slot] = timer->next;
+  if (timer->next != -1)
+    wheel->timers[timer->next].prev = timer->prev;
+  timer->level = -1;
+}
+
+/* Moves the timer of the element at index from to index to, whose timer
+ * should not be scheduled. Used when removing elements by swapping them with
+ * the last one. */
+static void move_timer(struct timer_wheel *wheel, int from, int to) {
+  struct timer *timer;
+
+  wheel->timers[to] = wheel->timers[from];
+  wheel->timers[from].level = -1;
+  timer = &wheel->timers[to];
+  if (timer->level == -1)
+    return;
+  if (timer->prev != -1)
+    wheel->timers[timer->prev].next = to;
+  else
+    wheel->slots[timer->level][timer->slot] = to;
+  if (timer->next != -1)
+    wheel->timers[timer->next].prev = to;
+}
+
+/* Advances the wheel up to now, returning the id of an expired timer, or -1
+ * when there are none left. Keep calling until it returns -1. */
+static int expire_timer(struct timer_wheel *wheel, time_t now) {
+  int id, next;
+
+  for (;;) {
+    id = wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+    if (id != -1) {
+      cancel_timer(wheel, id);
+      return id;
+    }
+    if (wheel->now >= now)
+      return -1;
+
+    wheel->now++;
+    if ((wheel->now & TIMER_WHEEL_MASK) == 0) {
+      /* Spread the next second-level slot over the first level. */
+      id = wheel->slots[1][(wheel->now >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK];
+      while (id != -1) {
+        next = wheel->timers[id].next;
+        schedule_timer(wheel, id, wheel->timers[id].deadline);
+        id = next;
+      }
+    }
+  }
+}
+
+static struct ip_count *find_ip_count(unsigned long ip) {
+  unsigned long i = hash_ulong(ip) & (IP_COUNTS_LEN - 1);
+  while (IP_COUNTS[i].count != 0 && IP_COUNTS[i].ip != ip)
+    i = (i + 1) & (IP_COUNTS_LEN - 1);
+  return &IP_COUNTS[i];
+}
+
+/* Counts a new connection from the IP, returning 0 if the IP already has
+ * CONFIG.max_connections_per_ip connections open, 1 otherwise. */
+static int add_ip_connection(unsigned long ip) {
+  struct ip_count *entry = find_ip_count(ip);
+  if (entry->count >= CONFIG.max_connections_per_ip)
+    return 0;
+  entry->ip = ip;
+  entry->count++;
+  return 1;
+}
+
+static void remove_ip_connection(unsigned long ip) {
+  unsigned long i, j, home;
+  struct ip_count *entry = find_ip_count(ip);
+
+  if (entry->count == 0 || --entry->count > 0)
+    return;
+
+  /* Shift the following entries back over the removed one, so that lookups
+   * don't need tombstones to find their way past it. */
+  i = entry - IP_COUNTS;
+  j = i;
+  for (;;) {
+    j = (j + 1) & (IP_COUNTS_LEN - 1);
+    if (IP_COUNTS[j].count == 0)
+      break;
+    home = hash_ulong(IP_COUNTS[j].ip) & (IP_COUNTS_LEN - 1);
+    if (((j - home) & (IP_COUNTS_LEN - 1)) >= ((j - i) & (IP_COUNTS_LEN - 1))) {
+      IP_COUNTS[i] = IP_COUNTS[j];
+      IP_COUNTS[j].count = 0;
+      i = j;
+    }
+  }
+}
+
+static void build_routes(void) {
+  unsigned long i;
+  size_t route;
+
+  for (route = 0; route < sizeof routes / sizeof routes[0]; route++) {
+    i = hash_string(routes[route].path) & (ROUTE_SLOTS_LEN - 1);
+    while (route_slots[i] != 0)
+      i = (i + 1) & (ROUTE_SLOTS_LEN - 1);
+    route_slots[i] = (unsigned char)(route + 1);
+  }
+}
+
+/* Builds the HPACK Huffman code from huffman_lengths. The code is canonical:
+ * the codes of each length are consecutive, in the order of the symbols, and
+ * follow the codes one bit shorter. */
+static void build_huffman(void) {
+  unsigned long code = 0;
+  int len, symbol, symbols_len = 0;
+
+  for (len = 1; len <= 30; len++) {
+    huffman_first_code[len] = code;
+    huffman_first_symbol[len] = symbols_len;
+    for (symbol = 0; symbol < 257; symbol++) {
+      if (huffman_lengths[symbol] == len) {
+        huffman_codes[symbol] = code++;
+        huffman_symbols[symbols_len++] = (short)symbol;
+      }
+    }
+    huffman_counts[len] = symbols_len - huffman_first_symbol[len];
+    code <<= 1;
+  }
+}
+
+/* Puts together the complete static responses. Returns -1 if one is in the
+ * wrong slot, or there's no memory for them. */
+static int build_static_responses(void) {
+  static char retry_after[80];
+  struct static_response *response;
+  size_t i;
+
+  sprintf(retry_after, "Retry-After: %ld\r\n%s", CONFIG.post_refill,
+          text_plain);
+  static_responses[RESPONSE_429].headers = retry_after;
+
+  for (i = 0; i < RESPONSE_COUNT; i++) {
+    response = &static_responses[i];
+    if (response->response != (enum response)i) {
+      fprintf(stderr, "static response %s is in the slot of %d\n",
+              response->status, (int)i);
+      return -1;
+    }
+    if (response->body == NULL)
+      continue;
+    /* The format, with room for the strings and a 64-bit length. */
+    response->raw = malloc(sizeof http_head_format + strlen(response->status) +
+                           strlen(response->headers) + 20 +
+                           response->body_len);
+    if (response->raw == NULL) {
+      perror("error allocating static responses");
+      return -1;
+    }
+    response->head_len =
+        sprintf(response->raw, http_head_format, response->status,
+                (long)response->body_len, response->headers);
+    memcpy(&response->raw[response->head_len], response->body,
+           response->body_len);
+    response->raw_len = response->head_len + response->body_len;
+  }
+  return 0;
+}
+
+static void free_static_responses(void) {
+  size_t i;
+  for (i = 0; i < RESPONSE_COUNT; i++) {
+    free(static_responses[i].raw);
+  }
+}
+
+/* Seconds from some fixed point, for the deadlines and expiry checks. The
+ * coarse clock is read without a syscall where the vDSO has it, and ticks
+ * often enough for one second precision. */
+static time_t monotonic_time(void) {
+#if defined(CLOCK_MONOTONIC_COARSE) || defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+    return ts.tv_sec;
+#endif
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec;
+#endif
+  return time(NULL);
+}
+
+#ifdef RISKYCHAT_TLS
+static SSL_CTX *create_tls_context(char *certificate_path, char *key_path) {
+  SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+  if (context == NULL) {
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+
+  /* The send loops retry with the rest of the buffer after partial writes. */
+  SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+  /* Let the kernel handle the record layer (via the "tls" ULP) when it can,
+   * which also makes sendfile() possible on the socket. */
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+
+  if (SSL_CTX_use_certificate_chain_file(context, certificate_path) != 1 ||
+      SSL_CTX_use_PrivateKey_file(context, key_path, SSL_FILETYPE_PEM) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(context);
+    return NULL;
+  }
+  return context;
+}
+#endif
+
+/* Answers with a 503 as far as the socket buffer allows, and closes the
+ * connection, without ever waiting on the client. */
+static void reject_connection(int fd) {
+  struct static_response *response = &static_responses[RESPONSE_503];
+#ifdef RISKYCHAT_TLS
+  /* A TLS client would not understand a plaintext 503, just hang up. */
+  if (TLS_CONTEXT == NULL)
+#endif
+    if (send(fd, response->raw, response->raw_len, 0) == -1 &&
+        CONFIG.verbose >= 1)
+      perror("error while rejecting connection");
+  if (CONFIG.verbose >= 2)
+    printf("<- rejected a connection with 503\n");
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+}
+
 #ifndef _WIN32
 static void handle_terminate(int sig) {
   if (sig == SIGINT || sig == SIGTERM) {
@@ -1079,7 +6121,481 @@ static void printf_clear_line(void) {
   printf("%c[2K", 27);
 }
 
-static void print_usage(char *program_name) {
-  fprintf(stderr, "Usage: %s [<address> <port>]\nExample: %s 127.0.0.1 8000\n",
+static void print_usage(FILE *out, char *program_name) {
+  size_t i;
+
+#ifdef RISKYCHAT_TLS
+  fprintf(out,
+          "Usage: %s [<flags>] [<address> <port> [<certificate> <private "
+          "key>]]\n"
+          "Example: %s --max-users 100 127.0.0.1 8443 cert.pem key.pem\n",
+          program_name, program_name);
+#else
+  fprintf(out,
+          "Usage: %s [<flags>] [<address> <port>]\n"
+          "Example: %s --max-users 100 127.0.0.1 8000\n",
           program_name, program_name);
+#endif
+  fprintf(out, "\nFlags, which can also be set in the file passed with "
+               "--config <path>, as\n\"name = value\" lines, or in the "
+               "environment variables:\n");
+  for (i = 0; i < sizeof options / sizeof options[0]; i++) {
+    fprintf(out, "  --%s, %s\n      %s\n", options[i].name, options[i].env,
+            options[i].help);
+  }
+}
+
+/* benches: A differential test and benchmark for decode_percent against the
+ * original strtol+memmove implementation. Compile with -DRISKYCHAT_DECODE_BENCH
+ * to replace the server with it. */
+
+#ifdef RISKYCHAT_DECODE_BENCH
+static void decode_percent_reference(char *buffer, size_t *buffer_len) {
+  char tol_buf[64], c;
+  size_t i;
+  for (i = 0; i < *buffer_len; i++) {
+    if (buffer[i] == '+')
+      buffer[i] = ' ';
+    else if (buffer[i] == '%' && buffer[i + 1] != '\0' &&
+             buffer[i + 2] != '\0') {
+      tol_buf[0] = buffer[i + 1];
+      tol_buf[1] = buffer[i + 2];
+      tol_buf[2] = '\0';
+      c = (char)strtol(tol_buf, NULL, 16);
+      buffer[i] = c;
+      memmove(&buffer[i + 1], &buffer[i + 3], *buffer_len - (i + 3));
+      *buffer_len -= 2;
+      buffer[*buffer_len] = '\0';
+    }
+  }
+}
+
+/* Fills the buffer with random form data. The reference implementation
+ * decodes invalid escapes (like "%zz") into garbage, so every '%' here is
+ * followed by hex digits, unless the input runs out. */
+static void random_form_data(char *buffer, size_t len, int escape_chance) {
+  static char plain[] = "abcdefghijklmnopqrstuvwxyz0123456789+-_.";
+  static char hex[] = "0123456789abcdefABCDEF";
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (rand() % 100 < escape_chance) {
+      buffer[i] = '%';
+      if (i + 1 < len)
+        buffer[++i] = hex[rand() % (sizeof hex - 1)];
+      if (i + 1 < len)
+        buffer[++i] = hex[rand() % (sizeof hex - 1)];
+    } else {
+      buffer[i] = plain[rand() % (sizeof plain - 1)];
+    }
+  }
+  buffer[len] = '\0';
+}
+
+static int decode_bench(void) {
+  static char a[1024], b[1024], source[65536 + 1], bench_buf[sizeof source];
+  size_t a_len, b_len, bench_len;
+  clock_t start, reference_time, new_time;
+  int i;
+
+  srand(1);
+  for (i = 0; i < 100000; i++) {
+    a_len = rand() % (sizeof a - 1);
+    random_form_data(a, a_len, rand() % 60);
+    memcpy(b, a, a_len + 1);
+    b_len = a_len;
+    decode_percent_reference(a, &a_len);
+    decode_percent(b, &b_len);
+    if (a_len != b_len || memcmp(a, b, a_len + 1) != 0) {
+      fprintf(stderr, "decode_percent mismatch on input %d\n", i);
+      return 1;
+    }
+  }
+  printf("decode_percent: %d random inputs match the reference\n", i);
+
+  random_form_data(source, sizeof source - 1, 30);
+  start = clock();
+  for (i = 0; i < 10; i++) {
+    memcpy(bench_buf, source, sizeof source);
+    bench_len = sizeof source - 1;
+    decode_percent_reference(bench_buf, &bench_len);
+  }
+  reference_time = clock() - start;
+  start = clock();
+  for (i = 0; i < 10; i++) {
+    memcpy(bench_buf, source, sizeof source);
+    bench_len = sizeof source - 1;
+    decode_percent(bench_buf, &bench_len);
+  }
+  new_time = clock() - start;
+  printf("decode_percent: reference %.2f ms, current %.2f ms (10 x %ld B)\n",
+         reference_time * 1000.0 / CLOCKS_PER_SEC,
+         new_time * 1000.0 / CLOCKS_PER_SEC, (long)(sizeof source - 1));
+  return 0;
+}
+#endif
+
+/* A benchmark for the search index, which also checks the results against a
+ * scan of every post. Compile with -DRISKYCHAT_SEARCH_BENCH to replace the
+ * server with it. */
+
+#ifdef RISKYCHAT_SEARCH_BENCH
+#define SEARCH_BENCH_POSTS 1000000L
+#define SEARCH_BENCH_POST_WORDS 8
+#define SEARCH_BENCH_WORDS 20000
+
+/* Picks a word, most often the first few, so that the index has both long
+ * and short posting lists, like actual text. */
+static int search_bench_word(void) {
+  double x = (double)rand() / RAND_MAX;
+  return (int)(x * x * x * (SEARCH_BENCH_WORDS - 1));
+}
+
+static int search_bench(void) {
+  static char *queries[] = {"w0",        "w1 w0",   "w2 w3 w4",  "w50",
+                            "w19000 w0", "w700 w1", "w12345",    "nope",
+                            "W0 w10",    "w1 w1",   "w30 w40 w0"};
+  struct search_index index;
+  struct word_splitter splitter;
+  size_t results[SEARCH_RESULTS_MAX], results_len, expected_len;
+  size_t expected[SEARCH_RESULTS_MAX];
+  unsigned short *words;
+  char text[SEARCH_BENCH_POST_WORDS * 8], query[64], *word;
+  clock_t start, index_time, search_time;
+  long post, i;
+  int query_words[SEARCH_WORDS_MAX], query_words_len, j, k, w;
+
+  words = malloc(SEARCH_BENCH_POSTS * SEARCH_BENCH_POST_WORDS *
+                 sizeof words[0]);
+  if (words == NULL)
+    return 1;
+  memset(&index, 0, sizeof index);
+  memset(&splitter, 0, sizeof splitter);
+  srand(1);
+  start = clock();
+  for (post = 0; post < SEARCH_BENCH_POSTS; post++) {
+    text[0] = '\0';
+    for (j = 0; j < SEARCH_BENCH_POST_WORDS; j++) {
+      w = search_bench_word();
+      words[post * SEARCH_BENCH_POST_WORDS + j] = (unsigned short)w;
+      sprintf(&text[strlen(text)], "w%d ", w);
+    }
+    index_post(&index, (size_t)post, &splitter, text, strlen(text));
+    index_post_end(&index, (size_t)post, &splitter);
+  }
+  index_time = clock() - start;
+
+  search_time = 0;
+  for (i = 0; i < (long)(sizeof queries / sizeof queries[0]); i++) {
+    start = clock();
+    results_len = search_posts(&index, 0, queries[i], results);
+    search_time += clock() - start;
+
+    /* The same search, by looking through every post. */
+    strcpy(query, queries[i]);
+    query_words_len = 0;
+    for (word = strtok(query, " "); word != NULL; word = strtok(NULL, " "))
+      query_words[query_words_len++] =
+          word[0] == 'w' || word[0] == 'W' ? atoi(&word[1]) : -1;
+    expected_len = 0;
+    for (post = SEARCH_BENCH_POSTS - 1;
+         post >= 0 && expected_len < SEARCH_RESULTS_MAX; post--) {
+      for (j = 0; j < query_words_len; j++) {
+        for (k = 0; k < SEARCH_BENCH_POST_WORDS; k++) {
+          if (words[post * SEARCH_BENCH_POST_WORDS + k] == query_words[j])
+            break;
+        }
+        if (k == SEARCH_BENCH_POST_WORDS)
+          break;
+      }
+      if (j == query_words_len)
+        expected[SEARCH_RESULTS_MAX - ++expected_len] = (size_t)post;
+    }
+    if (results_len != expected_len ||
+        memcmp(results, &expected[SEARCH_RESULTS_MAX - expected_len],
+               expected_len * sizeof results[0]) != 0) {
+      fprintf(stderr, "search_posts mismatch on \"%s\"\n", queries[i]);
+      return 1;
+    }
+  }
+  printf("search: %ld posts indexed in %.0f ms, %ld words, %ld KiB\n",
+         SEARCH_BENCH_POSTS, index_time * 1000.0 / CLOCKS_PER_SEC,
+         (long)index.lists_len, (long)(index.bytes / 1024));
+  printf("search: %ld queries match a scan, %.2f ms per query\n", i,
+         search_time * 1000.0 / CLOCKS_PER_SEC / i);
+  free_search_index(&index);
+  free(words);
+  return 0;
+}
+#endif
+
+/* fuzz: A harness for the connection state machine, which feeds the input to
+ * handle_connection through a socketpair, split at random points, like a
+ * client trickling it in. Compile with -DRISKYCHAT_FUZZ to replace the server
+ * with a driver that runs the files given to it (or stdin, for AFL), or with
+ * --stress <runs> [<seed>], random requests. For libFuzzer, compile with
+ * -DRISKYCHAT_LIBFUZZER -fsanitize=fuzzer. Either way, add
+ * -fsanitize=address,undefined to catch more than crashes.
+ *
+ * The first 4 bytes of an input seed the splits. If the lowest bit of the
+ * first byte is set, the sends and receives also fail with EAGAIN or come up
+ * short at random. The riskyid cookie of 32 zeros is always logged in. */
+
+#ifdef RISKYCHAT_FUZZ
+#define FUZZ_STEPS_MAX 100000
+
+static unsigned long FUZZ_RANDOM;
+static int FUZZ_IO_FAULTS;
+
+/* xorshift32, so that an input always runs the same way. */
+static unsigned long fuzz_random(void) {
+  FUZZ_RANDOM ^= FUZZ_RANDOM << 13 & 0xFFFFFFFFUL;
+  FUZZ_RANDOM ^= FUZZ_RANDOM >> 17;
+  FUZZ_RANDOM ^= FUZZ_RANDOM << 5 & 0xFFFFFFFFUL;
+  return FUZZ_RANDOM;
+}
+
+/* Called by the connection's I/O functions. Returns -1 with EAGAIN for a
+ * quarter of the calls, and shortens len for some of the rest. */
+static int fuzz_io_fault(size_t *len) {
+  if (!FUZZ_IO_FAULTS)
+    return 0;
+  switch (fuzz_random() % 4) {
+  case 0:
+    errno = EAGAIN;
+    return -1;
+  case 1:
+    if (*len > 1)
+      *len = 1 + fuzz_random() % (*len - 1);
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+/* Sets up the server's state like main does, with small limits so that they
+ * get hit. */
+static int fuzz_init(void) {
+  CONFIG.max_users = 8;
+  CONFIG.max_rooms = 4;
+  CONFIG.max_connections = 4;
+  CONFIG.max_line = 512;
+  CONFIG.max_login_body = 64;
+  CONFIG.max_post_body = 1024;
+  CONFIG.body_pool = 2;
+  CONFIG.history_limit = 4096;
+  CONFIG.room_timeout = 8;
+  if (build_static_responses() == -1 || allocate_tables() == -1)
+    return -1;
+  build_routes();
+  build_huffman();
+  USERS_LEN = 1;
+  RANDOM_SOURCE = fopen("/dev/urandom", "rb");
+  NOW = monotonic_time();
+  if (RANDOM_SOURCE == NULL ||
+      init_timer_wheel(&CONNECTION_TIMERS, CONFIG.max_connections, NOW) ==
+          -1 ||
+      init_timer_wheel(&USER_TIMERS, CONFIG.max_users + 1, NOW) == -1 ||
+      init_timer_wheel(&ROOM_TIMERS, CONFIG.max_rooms + 1, NOW) == -1)
+    return -1;
+  ROOMS_LEN = 1;
+  ROOMS[0].history = tmpfile();
+  return ROOMS[0].history == NULL ? -1 : 0;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+  static int initialized = 0;
+  static unsigned char fuzz_token[SESSION_TOKEN_LEN];
+  struct connection_ctx ctx;
+  char response[4096], *name;
+  size_t written, chunk;
+  ssize_t result;
+  int fds[2], i;
+  long step;
+
+  if (!initialized) {
+    if (fuzz_init() == -1) {
+      perror("error setting up the fuzzing");
+      abort();
+    }
+    initialized = 1;
+  }
+  if (size < 4)
+    return 0;
+  FUZZ_RANDOM = get_u32((unsigned char *)data) | 1;
+  FUZZ_IO_FAULTS = data[0] & 1;
+  data += 4;
+  size -= 4;
+
+  /* A second passes per input, so the rate limits, users and rooms
+   * expire. */
+  NOW++;
+  while ((i = expire_timer(&USER_TIMERS, NOW)) != -1)
+    remove_user(i);
+  while ((i = expire_timer(&ROOM_TIMERS, NOW)) != -1)
+    remove_room(i);
+  if (find_session(fuzz_token) == 0 && (name = malloc(5)) != NULL) {
+    strcpy(name, "fuzz");
+    if (is_name_reserved(name) || add_user(name, fuzz_token) == 0)
+      free(name);
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("error creating a socketpair");
+    abort();
+  }
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  memset(&ctx, 0, sizeof ctx);
+  ctx.connect_fd = fds[0];
+  ctx.ip = 0x0100007FUL;
+
+  written = 0;
+  if (size == 0)
+    shutdown(fds[1], SHUT_WR);
+  for (step = 0; step < FUZZ_STEPS_MAX; step++) {
+    if (written < size) {
+      chunk = size - written < 64 ? size - written : 64;
+      chunk = 1 + fuzz_random() % chunk;
+      result = send(fds[1], &data[written], chunk, 0);
+      if (result > 0)
+        written += result;
+      if (written == size)
+        shutdown(fds[1], SHUT_WR); /* The client is done. */
+    }
+    /* Read the response as it comes, so that the server's sends don't
+     * block on a full socket. */
+    while (recv(fds[1], response, sizeof response, 0) > 0)
+      ;
+
+    result = handle_connection(&ctx);
+    if (result == 0)
+      break;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* Dropped, like in the main loop. */
+      cleanup_connection(&ctx);
+      break;
+    }
+  }
+  if (step == FUZZ_STEPS_MAX)
+    cleanup_connection(&ctx); /* Timed out, like in the main loop. */
+  close(fds[1]);
+  return 0;
+}
+
+/* Runs the inputs in the files, or stdin. */
+static int fuzz_files(int argc, char **argv) {
+  static unsigned char input[1 << 20];
+  size_t len;
+  FILE *file;
+  int i;
+
+  for (i = 1; i == 1 || i < argc; i++) {
+    file = i < argc ? fopen(argv[i], "rb") : stdin;
+    if (file == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    len = fread(input, 1, sizeof input, file);
+    if (file != stdin)
+      fclose(file);
+    LLVMFuzzerTestOneInput(input, len);
+  }
+  return 0;
+}
+
+/* A stress test request, which can have NULs, as the HTTP/2 ones do. */
+struct fuzz_request {
+  char *data;
+  size_t len;
+};
+#define FUZZ_REQUEST(s) {s, sizeof s - 1}
+
+/* Runs random mutations of a few requests, with the I/O faults on. */
+static int fuzz_stress(long runs, unsigned long seed) {
+  static struct fuzz_request requests[] = {
+      FUZZ_REQUEST("GET / HTTP/1.1\r\n"
+                   "Cookie: riskyid=00000000000000000000000000000000\r\n\r\n"),
+      FUZZ_REQUEST("POST /post HTTP/1.1\r\nContent-Length: 20\r\n"
+                   "Cookie: a=b; riskyid=00000000000000000000000000000000\r\n"
+                   "\r\ncontent=h%C3%A4llo+w"),
+      FUZZ_REQUEST("POST /r/fuzz/post HTTP/1.1\r\nContent-Length: 15\r\n"
+                   "Cookie: riskyid=00000000000000000000000000000000\r\n\r\n"
+                   "content=%3Cb%3E"),
+      FUZZ_REQUEST("GET /r/fuzz/?page=1 HTTP/1.1\r\n"
+                   "Cookie: riskyid=00000000000000000000000000000000\r\n\r\n"),
+      FUZZ_REQUEST("POST /login HTTP/1.1\r\nContent-Length: 10\r\n\r\n"
+                   "name=fuzzy"),
+      FUZZ_REQUEST("POST /login HTTP/1.1\r\nContent-Length: -5\r\n\r\nname="),
+      FUZZ_REQUEST("GET /r/fuzz/search?x&q=H%C3%A4llo+b&q=w HTTP/1.1\r\n"
+                   "Cookie: riskyid=00000000000000000000000000000000\r\n\r\n"),
+      FUZZ_REQUEST("HEAD /metrics HTTP/1.1\r\n\r\n"),
+      FUZZ_REQUEST("HEAD /r/x HTTP/1.1\r\n\r\n"),
+      FUZZ_REQUEST("GET /nope HTTP/1.1\r\n\r\n"),
+      /* HTTP/2 with prior knowledge: a stream indexing the cookie, then a
+       * POST reusing it, and a PING. */
+      FUZZ_REQUEST("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+                   "\000\000\006\004\000\000\000\000\000\000\002\000\000\000"
+                   "\000\000\000\037\001\005\000\000\000\001\202\204\206`\232"
+                   "\260\310\353\350\322@\000\000\000\000\000\000\000\000\000"
+                   "\000\000\000\000\000\000\000\000\000\000\001\000\000\r"
+                   "\001\004\000\000\000\003\203D\204b\263\241\077\206\277\\"
+                   "\202\010\077\000\000\n\000\001\000\000\000\003content=h2"
+                   "\000\000\010\006\000\000\000\000\00012345678"),
+      /* A padded, prioritized HEADERS with a CONTINUATION and Huffman coded
+       * strings, and a 16-byte window to start the response with. */
+      FUZZ_REQUEST("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+                   "\000\000\006\004\000\000\000\000\000\000\004\000\000\000"
+                   "\020\000\000\023\001)\000\000\000\001\003\000\000\000\000"
+                   "\020\202D\214b\306%\267\337\266\077\000\000\000\000\000-"
+                   "\011\004\000\000\000\001\312\3071`\017\206A\204\226\337~"
+                   "\377`\203\034\021\377`\232\260\310\353\350\322@\000\000"
+                   "\000\000\000\000\000\000\000\000\000\000\000\000\000\000"
+                   "\000\000\000\001\000\000\004\010\000\000\000\000\001\000"
+                   "\001\000\000\000\000\004\010\000\000\000\000\000\000\001"
+                   "\000\000"),
+      /* An upgrade, then a stream of the client's own, a reset and GOAWAY. */
+      FUZZ_REQUEST("GET /search\077q=h2 HTTP/1.1\r\n"
+                   "Connection: Upgrade, HTTP2-Settings\r\n"
+                   "Upgrade: websocket, h2c\r\n"
+                   "HTTP2-Settings: AAMAAABkAAQAAP__\r\n"
+                   "Cookie: riskyid=00000000000000000000000000000000\r\n\r\n"
+                   "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+                   "\000\000\000\004\000\000\000\000\000\000\000\017\001\005"
+                   "\000\000\000\003B\204\307\202\033\377D\206b\222\246\303"
+                   "\021\037\206\000\000\004\003\000\000\000\000\003\000\000"
+                   "\000\010\000\000\010\007\000\000\000\000\000\000\000\000"
+                   "\003\000\000\000\000"),
+  };
+  unsigned char input[4 + 1024];
+  struct fuzz_request *request;
+  size_t len;
+  long run;
+  int mutations;
+
+  srand((unsigned int)seed);
+  for (run = 0; run < runs; run++) {
+    request = &requests[rand() % (sizeof requests / sizeof requests[0])];
+    len = request->len;
+    memcpy(&input[4], request->data, len);
+    /* Overwrite or cut off a few bytes. */
+    for (mutations = rand() % 4; mutations > 0; mutations--) {
+      if (rand() % 2 == 0)
+        input[4 + rand() % len] = (unsigned char)rand();
+      else
+        len = 1 + rand() % len;
+    }
+    put_u32(input, (unsigned long)rand() << 16 ^ (unsigned long)rand());
+    input[0] |= 1;
+    LLVMFuzzerTestOneInput(input, 4 + len);
+  }
+  printf("fuzz: %ld stress runs passed (seed %lu)\n", runs, seed);
+  return 0;
+}
+
+static int fuzz_main(int argc, char **argv) {
+  if (argc >= 3 && strcmp(argv[1], "--stress") == 0)
+    return fuzz_stress(atol(argv[2]),
+                       argc >= 4 ? strtoul(argv[3], NULL, 10) : 1);
+  return fuzz_files(argc, argv);
 }
+#endif
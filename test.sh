@@ -1,10 +1,21 @@
 #!/bin/sh
 set -e
 
+echo "[$0] Checking percent-decoding against the reference implementation..."
+cc riskychat.c -DRISKYCHAT_DECODE_BENCH -otest_decode_bench
+./test_decode_bench >/dev/null
+rm test_decode_bench
+
+echo "[$0] Stress-testing the request handling with random inputs..."
+cc riskychat.c -DRISKYCHAT_FUZZ -otest_fuzz
+./test_fuzz --stress 2000 >/dev/null
+rm test_fuzz
+
 echo "[$0] Building server..."
 cc riskychat.c -otest_riskychat
+./test_riskychat --help | grep -- '--max-users' >/dev/null
 echo "[$0] Launching server..."
-./test_riskychat 127.0.0.1 12345 >/dev/null &
+./test_riskychat --max-users 100 --control-socket test_control 127.0.0.1 12345 >/dev/null &
 SERVER_PID=$!
 sleep 1 # wait for the server to be functional, since it lacks a "daemonized" mode
 
@@ -12,16 +23,134 @@ echo "[$0] Server forked off, running tests..."
 
 
 # Create the user
-curl -s --no-keepalive -d "name=testuser" http://127.0.0.1:12345/login
+curl -s --no-keepalive -c test_cookies -d "name=testuser" http://127.0.0.1:12345/login
 # Post a message
-curl -s --no-keepalive --cookie "riskyid=1" -d "content=hellooo" http://127.0.0.1:12345/post
+curl -s --no-keepalive -b test_cookies -d "content=hellooo" http://127.0.0.1:12345/post
+# Post a percent-encoded message
+curl -s --no-keepalive -b test_cookies -d "content=h%C3%A4llo+w%6Frld" http://127.0.0.1:12345/post
+# Post to a room
+curl -s --no-keepalive -b test_cookies -d "content=roomie" http://127.0.0.1:12345/r/testroom/post
+# Check that oversized posts are rejected
+BIG_POST=$(head -c 5000 /dev/zero | tr '\0' 'a')
+curl -s --no-keepalive -b test_cookies -o /dev/null -w '%{http_code}' -d "content=$BIG_POST" http://127.0.0.1:12345/post | grep 413 >/dev/null
+curl -s --no-keepalive -b test_cookies -o /dev/null -D - -d "content=$BIG_POST" http://127.0.0.1:12345/post | grep 'Content-Type: text/plain' >/dev/null
+# Check that posting is rate limited
+for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+  curl -s --no-keepalive -b test_cookies -o /dev/null -w '%{http_code}\n' -d "content=spam" http://127.0.0.1:12345/post
+done | grep 429 >/dev/null
+sleep 1
+# Check that the messages are now shown on the page
+curl -s --no-keepalive -b test_cookies http://127.0.0.1:12345/ | grep 'hellooo' >/dev/null
+curl -s --no-keepalive -b test_cookies http://127.0.0.1:12345/ | grep 'hällo world' >/dev/null
+# Check that the query string is split off before routing
+curl -s --no-keepalive -b test_cookies 'http://127.0.0.1:12345/?page=2' | grep 'hellooo' >/dev/null
+# Check that the room's post is only shown in the room
+curl -s --no-keepalive -b test_cookies http://127.0.0.1:12345/r/testroom/ | grep 'roomie' >/dev/null
+if curl -s --no-keepalive -b test_cookies http://127.0.0.1:12345/ | grep 'roomie' >/dev/null; then
+  exit 1
+fi
+# Check that the search finds only the matching posts
+curl -s --no-keepalive -b test_cookies 'http://127.0.0.1:12345/search?q=WORLD+H%C3%A4LLO' | grep 'hällo world' >/dev/null
+if curl -s --no-keepalive -b test_cookies 'http://127.0.0.1:12345/search?q=world' | grep 'hellooo' >/dev/null; then
+  exit 1
+fi
+curl -s --no-keepalive http://127.0.0.1:12345/metrics | grep 'riskychat_search_index_bytes [1-9]' >/dev/null
+# Check that the old sequential ids don't work as sessions
+curl -s --no-keepalive --cookie "riskyid=1" http://127.0.0.1:12345/ | grep 'Login to Risky Chat' >/dev/null
+# Restart the server, and check that the session and the posts survive
+./test_riskychat --max-users 100 --control-socket test_control 127.0.0.1 12345 >/dev/null &
+NEW_SERVER_PID=$!
+wait $SERVER_PID # the old server exits after handing off to the new one
+SERVER_PID=$NEW_SERVER_PID
+curl -s --no-keepalive -b test_cookies http://127.0.0.1:12345/ | grep 'hellooo' >/dev/null
+curl -s --no-keepalive -b test_cookies http://127.0.0.1:12345/r/testroom/ | grep 'roomie' >/dev/null
+curl -s --no-keepalive -b test_cookies 'http://127.0.0.1:12345/search?q=hellooo' | grep 'hellooo' >/dev/null
+# Run two more servers replicating to each other, over TCP one way and a unix
+# socket the other, and check that a login and a post on one show up on both
+./test_riskychat --replicate-listen 127.0.0.1:12348 --peers ./test_replicate 127.0.0.1 12347 >/dev/null &
+REPLICA_A_PID=$!
+./test_riskychat --replicate-listen ./test_replicate --peers 127.0.0.1:12348 127.0.0.1 12349 >/dev/null &
+REPLICA_B_PID=$!
+sleep 1
+curl -s --no-keepalive -c test_replica_cookies -d "name=replicated" http://127.0.0.1:12347/login
+curl -s --no-keepalive -b test_replica_cookies -d "content=hello+there" http://127.0.0.1:12347/post
+sleep 1
+curl -s --no-keepalive -b test_replica_cookies http://127.0.0.1:12349/ | grep 'hello there' >/dev/null
+# Check HTTP/2, with prior knowledge and by upgrading, if curl has it
+if curl -V | grep HTTP2 >/dev/null; then
+  curl -s --http2-prior-knowledge -c test_h2_cookies -d "name=h2user" http://127.0.0.1:12347/login
+  curl -s --http2-prior-knowledge -b test_h2_cookies -d "content=over+h2" http://127.0.0.1:12347/post
+  curl -s --http2-prior-knowledge -b test_h2_cookies http://127.0.0.1:12347/ | grep 'over h2' >/dev/null
+  curl -s --http2 -b test_h2_cookies -o /dev/null -w '%{http_version}' http://127.0.0.1:12347/ | grep -x 2 >/dev/null
+  curl -s --http2-prior-knowledge -I http://127.0.0.1:12347/nothere | grep '^HTTP/2 404' >/dev/null
+fi
+kill -s TERM $REPLICA_A_PID $REPLICA_B_PID
+# Run a server keeping a small replication log, post past it, and check that a
+# new follower is resynced, keeping the session whose login was dropped, and
+# that it stays connected to get a later post
+./test_riskychat --replicate-listen ./test_replicate_trim --history-limit 300 --post-burst 100 127.0.0.1 12351 >/dev/null &
+TRIM_PID=$!
 sleep 1
-# Check that the message is now shown on the page
-curl -s --no-keepalive --cookie "riskyid=1" http://127.0.0.1:12345/ | grep 'hellooo' >/dev/null
+curl -s --no-keepalive -c test_trim_cookies -d "name=trimmer" http://127.0.0.1:12351/login
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+  curl -s --no-keepalive -b test_trim_cookies -d "content=trim$i" http://127.0.0.1:12351/post
+done
+./test_riskychat --verbose 1 --peers ./test_replicate_trim 127.0.0.1 12352 >test_trim_log &
+TRIM_FOLLOWER_PID=$!
+sleep 1
+curl -s --no-keepalive -b test_trim_cookies -d "content=after+trim" http://127.0.0.1:12351/post
+sleep 1
+curl -s --no-keepalive -b test_trim_cookies http://127.0.0.1:12352/ | grep 'after trim' >/dev/null
+kill -s TERM $TRIM_PID $TRIM_FOLLOWER_PID
+wait $TRIM_FOLLOWER_PID || true # for its output to be flushed
+grep 'following ./test_replicate_trim from event [1-9]' test_trim_log >/dev/null
+if grep 'lost the replication connection' test_trim_log >/dev/null; then
+  exit 1
+fi
+# Run a server with short-lived rooms, and check that a room without posts is
+# removed, unless a slow reader is still being sent its history, and that the
+# freed slot is reused
+./test_riskychat --room-timeout 3 --max-rooms 2 --max-post-body 3000000 --post-burst 100 127.0.0.1 12350 >/dev/null &
+ROOMS_PID=$!
+sleep 1
+curl -s --no-keepalive -c test_rooms_cookies -d "name=roomuser" http://127.0.0.1:12350/login
+curl -s --no-keepalive -b test_rooms_cookies -d "content=idlepost" http://127.0.0.1:12350/r/idleroom/post
+printf 'content=' >test_big_post
+head -c 2000000 /dev/zero | tr '\0' 'a' >>test_big_post
+for i in 1 2 3; do
+  curl -s --no-keepalive -b test_rooms_cookies -d @test_big_post http://127.0.0.1:12350/r/busyroom/post
+done
+curl -s --no-keepalive --limit-rate 1k -b test_rooms_cookies -o /dev/null http://127.0.0.1:12350/r/busyroom/ &
+READER_PID=$!
+sleep 5
+curl -s --no-keepalive http://127.0.0.1:12350/metrics | grep -x 'riskychat_rooms 2' >/dev/null
+if curl -s --no-keepalive -b test_rooms_cookies http://127.0.0.1:12350/r/idleroom/ | grep 'idlepost' >/dev/null; then
+  exit 1
+fi
+curl -s --no-keepalive -b test_rooms_cookies -d "content=reused" http://127.0.0.1:12350/r/newroom/post
+curl -s --no-keepalive -b test_rooms_cookies http://127.0.0.1:12350/r/newroom/ | grep 'reused' >/dev/null
+kill $READER_PID
+kill -s TERM $ROOMS_PID
 
 echo "[$0] Tests passed! Shutting down the server and cleaning up..."
 kill -s TERM $SERVER_PID
-kill -s KILL $SERVER_PID
+kill -s KILL $SERVER_PID 2>/dev/null || true
 sleep 1 # wait for it to really die? port seems to stay bound...
 
-rm test_riskychat
+if command -v openssl >/dev/null &&
+  cc riskychat.c -DRISKYCHAT_TLS -otest_riskychat_tls -lssl -lcrypto 2>/dev/null; then
+  echo "[$0] Testing TLS with a self-signed certificate..."
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout test_key.pem -out test_cert.pem 2>/dev/null
+  ./test_riskychat_tls 127.0.0.1 12346 test_cert.pem test_key.pem >/dev/null &
+  TLS_SERVER_PID=$!
+  sleep 1
+  curl -sk --no-keepalive https://127.0.0.1:12346/ | grep 'Login to Risky Chat' >/dev/null
+  kill -s TERM $TLS_SERVER_PID
+  rm test_riskychat_tls test_cert.pem test_key.pem
+else
+  echo "[$0] Could not build with OpenSSL, skipping the TLS test."
+fi
+
+rm -f test_riskychat test_cookies test_control test_replica_cookies test_replicate test_h2_cookies \
+  test_rooms_cookies test_big_post test_replicate_trim test_trim_cookies test_trim_log